@@ -0,0 +1,992 @@
+#include "design_patterns_creational.hpp"
+#include "design_patterns_structural.hpp"
+#include "design_patterns_behavioural.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <execution>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+// Benchmarks of the patterns, run all of them or only the ones
+// whose name contains the first argument:
+//
+//   ./design_patterns_bench [name]
+
+static const char * filter_ = 0;
+
+static bool selected(const char * name)
+{
+  if (filter_ && !std::strstr(name, filter_))
+    return false;
+  std::cout << "Benchmark of " << name << std::endl;
+  return true;
+}
+
+// wall clock seconds taken by f()
+template <typename F>
+static double seconds(F f)
+{
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char * what, double n, double secs,
+		   const char * unit = "ops")
+{
+  std::cout << "\t" << what << ": " << n / secs / 1e6
+	    << " M" << unit << "/s (" << secs << " s)" << std::endl;
+}
+
+namespace {
+
+  // a receiver cheap enough not to hide the cost of the pattern
+
+  struct tally{
+
+    tally() : sum_(0) {};
+    void add(int v) { sum_ += v; }
+    long sum_;
+  };
+
+  // the observers as a vector behind a mutex
+
+  class locked_subject{
+
+  public:
+    void attach(Behavioural_Patterns::Observer::observer * o)
+    { std::lock_guard<std::mutex> lock(mutex_); observers_.push_back(o); }
+
+    void detach(Behavioural_Patterns::Observer::observer * o)
+    { 
+      std::lock_guard<std::mutex> lock(mutex_); 
+      observers_.erase(std::remove(observers_.begin(), observers_.end(), o),
+		       observers_.end());
+    }
+
+    void set_value(int value)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (std::size_t i = 0; i < observers_.size(); ++i)
+	observers_[i]->update(value);
+    }
+
+  private:
+    std::mutex mutex_;
+    std::vector<Behavioural_Patterns::Observer::observer *> observers_;
+  };
+
+  struct quiet_observer : public Behavioural_Patterns::Observer::observer{
+
+    void update(int value) {}
+  };
+
+  // a_specific_command, for a tally
+
+  class tally_command final : 
+    public Behavioural_Patterns::Command::command{
+
+  public:
+    tally_command(tally * r, void (tally::*a)(int)) : 
+      receiver_(r), action_(a) {};
+    void execute(int what) { (receiver_->*action_)(what); }
+
+  private:
+    tally * receiver_;
+    void (tally::*action_)(int);
+  };
+
+  // a visitor that counts the elements, through double dispatch
+
+  struct counting_visitor 
+    : public Behavioural_Patterns::Visitor::parent_element_visitor{
+
+    static constexpr bool thread_safe = false;
+
+    counting_visitor() : a(0), b(0), c(0) {};
+    void visit(Behavioural_Patterns::Visitor::A & e) const { a += touch(e); }
+    void visit(Behavioural_Patterns::Visitor::B & e) const { b += touch(e); }
+    void visit(Behavioural_Patterns::Visitor::C & e) const { c += touch(e); }
+    void visit(Behavioural_Patterns::Visitor::Parent & p) const
+    {
+      for (std::size_t i = 0; i < p.getElements().size(); ++i)
+	p.getElements()[i]->accept(*this);
+    }
+
+    void merge(const counting_visitor & o) { a += o.a; b += o.b; c += o.c; }
+
+    // the first word of the element, its vtable pointer
+    template <typename T>
+    static std::size_t touch(const T & e)
+    {
+      std::size_t w;
+      std::memcpy(&w, &e, sizeof(w));
+      return w & 1 ? 2 : 1;
+    }
+    mutable std::size_t a, b, c;
+  };
+
+}
+
+// the element by element comparison through the iterator
+
+static bool walk_equal(const Behavioural_Patterns::Iterator::stack & s1,
+		       const Behavioural_Patterns::Iterator::stack & s2)
+{
+  using  namespace Behavioural_Patterns::Iterator;
+
+  iterator it1(s1), it2(s2);
+  for (; it1(); ++it1, ++it2)
+    if (*it1 != *it2)
+      return false;
+  return true;
+}
+
+void behavioural(){
+
+  if (selected("Command journal")){
+
+    using  namespace Behavioural_Patterns::Command;
+
+    const char * path = "bench.journal";
+    const int n = 4000000;
+    std::remove(path);
+
+    tally t;
+    for (std::size_t group : { 64, 4096 }){
+      {
+	command_journal<tally> journal(path, group);
+	std::uint32_t r = journal.add_receiver(&t);
+	std::uint32_t a = journal.add_action(&tally::add);
+	double s = seconds([&] { for (int i = 0; i < n; ++i)
+				   journal.append(r, a, i);
+				 journal.commit(); });
+	std::cout << "\tgroup commit every " << group << std::endl;
+	report("append", n, s, "records");
+      }
+      std::remove(path);
+    }
+
+    {
+      command_journal<tally> journal(path);
+      std::uint32_t r = journal.add_receiver(&t);
+      std::uint32_t a = journal.add_action(&tally::add);
+      for (int i = 0; i < n; ++i)
+	journal.append(r, a, i);
+    }
+
+    tally restarted;
+    double s = seconds([&] { command_journal<tally> journal(path);
+			     journal.add_receiver(&restarted);
+			     journal.add_action(&tally::add);
+			     journal.replay(); });
+    report("open and replay", n, s, "records");
+    std::remove(path);
+  }
+
+  if (selected("Command by value")){
+
+    using  namespace Behavioural_Patterns::Command;
+
+    const int n = 10000000;
+    tally t;
+
+    {
+      std::vector<tally_command *> commands;  // called as command *
+      commands.reserve(n);
+      double c = seconds([&] { for (int i = 0; i < n; ++i)
+				 commands.push_back
+				   (new tally_command(&t, &tally::add)); });
+      double e = seconds([&] { for (int i = 0; i < n; ++i)
+				 static_cast<command *>(commands[i])->execute(i); });
+      double d = seconds([&] { for (int i = 0; i < n; ++i)
+				 delete commands[i]; });
+      std::cout << "\tnew a_specific_command" << std::endl;
+      report("create", n, c);
+      report("execute", n, e);
+      report("destroy", n, d);
+    }
+
+    {
+      std::vector<small_command<> > commands;
+      commands.reserve(n);
+      double c = seconds([&] { for (int i = 0; i < n; ++i)
+				 commands.emplace_back(&t, &tally::add); });
+      double e = seconds([&] { for (int i = 0; i < n; ++i)
+				 commands[i].execute(i); });
+      double d = seconds([&] { commands.clear(); });
+      std::cout << "\tsmall_command" << std::endl;
+      report("create", n, c);
+      report("execute", n, e);
+      report("destroy", n, d);
+    }
+    std::cout << "\t(sum " << t.sum_ << ")" << std::endl;
+  }
+
+  if (selected("Iterator stack")){
+
+    using  namespace Behavioural_Patterns::Iterator;
+
+    for (std::size_t n : { 1000ul, 1000000ul, 100000000ul }){
+
+      const std::size_t reps = std::max<std::size_t>(1, 200000000 / n);
+      std::vector<int> values(n);
+      for (std::size_t i = 0; i < n; ++i)
+	values[i] = i;
+
+      std::cout << "\t" << n << " items" << std::endl;
+
+      stack s1, s2;
+      double p = seconds([&] { for (std::size_t r = 0; r < reps; ++r){
+				 s1.pop_n(n);
+				 for (std::size_t i = 0; i < n; ++i)
+				   s1.push(values[i]);
+			       } });
+      report("push", double(n) * reps, p, "items");
+
+      p = seconds([&] { for (std::size_t r = 0; r < reps; ++r){
+			  s2.pop_n(n);
+			  s2.push_range(values);
+			} });
+      report("push_range", double(n) * reps, p, "items");
+
+      bool same = true;
+      double w = seconds([&] { for (std::size_t r = 0; r < reps; ++r)
+				 same &= walk_equal(s1, s2); });
+      report("iterator walk ==", double(n) * reps, w, "items");
+
+      double e = seconds([&] { for (std::size_t r = 0; r < reps; ++r)
+				 same &= (s1 == s2); });
+      report("blocked ==", double(n) * reps, e, "items");
+      if (!same)
+	std::cout << "\tstacks differ!" << std::endl;
+    }
+  }
+
+  if (selected("Iterator parallel algorithms")){
+
+    using  namespace Behavioural_Patterns::Iterator;
+
+    const std::size_t n = 20000000;
+    std::cout << "\t" << n << " items, " 
+	      << std::thread::hardware_concurrency() << " cores" << std::endl;
+
+    stack base;
+    base.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+      base.push((i * 2654435761u) >> 4);
+
+    auto run = [&](const char * name, auto policy){
+
+      stack s(base);
+      long sum = 0;
+      double t = seconds([&] { std::transform(policy, s.begin(), s.end(), 
+					      s.begin(), 
+					      [](int v) { return v / 3 + 1; }); });
+      double r = seconds([&] { sum = std::reduce(policy, s.begin(), s.end(), 
+						 0l); });
+      double o = seconds([&] { std::sort(policy, s.begin(), s.end()); });
+
+      std::cout << "\t" << name << " (sum " << sum << ")" << std::endl;
+      report("transform", n, t, "items");
+      report("reduce", n, r, "items");
+      report("sort", n, o, "items");
+    };
+
+    run("seq", std::execution::seq);
+    run("par_unseq", std::execution::par_unseq);
+  }
+
+  if (selected("Iterator pipelines")){
+
+    using  namespace Behavioural_Patterns::Iterator;
+
+    const std::size_t n = 10000000, reps = 10;
+    stack s;
+    s.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+      s.push((i * 2654435761u) >> 8);
+
+    auto odd = [](int v) { return (v & 1) != 0; };
+    auto scale = [](int v) { return v / 4 + 3; };
+    long check[3] = { 0, 0, 0 };
+
+    double m = seconds([&] { for (std::size_t r = 0; r < reps; ++r){
+			       stack filtered, mapped;   // every step
+			       for (iterator it(s); it(); ++it)
+				 if (odd(*it))
+				   filtered.push(*it);
+			       for (iterator it(filtered); it(); ++it)
+				 mapped.push(scale(*it));
+			       long sum = 0;
+			       for (iterator it(mapped); it(); ++it)
+				 sum += *it;
+			       check[0] += sum;
+			     } });
+    report("materialized stacks", double(n) * reps, m, "items");
+
+    auto p = pipe(s) | filter(odd) | map(scale);
+
+    double f = seconds([&] { for (std::size_t r = 0; r < reps; ++r)
+			       check[1] += p | reduce(0l); });
+    report("fused pipeline", double(n) * reps, f, "items");
+
+    double c = seconds([&] { for (std::size_t r = 0; r < reps; ++r)
+			       check[2] += p.chunked(1024) | reduce(0l); });
+    report("chunked pipeline", double(n) * reps, c, "items");
+
+    long blocks = 0;         // the sum as a kernel over each block
+    double k = seconds([&] { for (std::size_t r = 0; r < reps; ++r)
+			       p.chunked(1024) | for_each_block
+				 ([&blocks](const int * b, std::size_t n){
+				   long sum = 0;
+				   for (std::size_t j = 0; j < n; ++j)
+				     sum += b[j];
+				   blocks += sum;
+				 }); });
+    report("chunked pipeline, block kernel", double(n) * reps, k, "items");
+
+    if (check[0] != check[1] || check[1] != check[2] || check[2] != blocks)
+      std::cout << "\tresults differ!" << std::endl;
+  }
+
+  if (selected("Mediator traverse")){
+
+    using  namespace Behavioural_Patterns::Mediator;
+
+    const std::size_t n = 10000000;
+
+    std::vector<node *> nodes(n);   // nodes living anywhere
+    for (std::size_t i = 0; i < n; ++i)
+      nodes[i] = new node(i * 7919);
+    std::shuffle(nodes.begin(), nodes.end(), std::mt19937(1));
+
+    list l;
+    node_list owned;
+    owned.reserve(n);
+    for (std::size_t i = 0; i < n; ++i){
+      l.add(nodes[i]);
+      owned.add(nodes[i]->getValue());
+    }
+
+    double p = seconds([&] { l.traverse(); Logging::flush(); });
+    double c = seconds([&] { owned.traverse(); Logging::flush(); });
+
+    report("list of node *", n, p, "nodes");
+    report("node_list", n, c, "nodes");
+
+    for (std::size_t i = 0; i < n; ++i)
+      delete nodes[i];
+  }
+
+  if (selected("Memento history")){
+
+    using  namespace Behavioural_Patterns::Memento;
+
+    struct big_state { int cells[1 << 18]; };   // 1MB
+    const std::size_t snapshots = 2000, budget = 256 << 20;
+
+    std::mt19937 rng(7);
+    std::unique_ptr<big_state> s(new big_state()), r(new big_state());
+
+    for (std::size_t changed : { 16, 256, 4096 }){
+
+      memento_history<big_state> history(budget);
+      double t = seconds([&] { for (std::size_t i = 0; i < snapshots; ++i){
+				 for (std::size_t c = 0; c < changed; ++c)
+				   s->cells[rng() % (1 << 18)] = rng();
+				 history.save(*s);
+			       } });
+
+      std::size_t restores = 1000;
+      double l = seconds([&] { for (std::size_t i = 0; i < restores; ++i)
+				 history.restore(history.oldest() + 
+						 rng() % history.size(), *r); });
+
+      std::cout << "\t" << changed << " cells changed per snapshot, " 
+		<< history.size() << " snapshots kept" << std::endl
+		<< "\t\tbytes per snapshot " 
+		<< history.bytes() / history.size() 
+		<< " (full copy " << sizeof(big_state) << ")" << std::endl
+		<< "\t\tsave " << t / snapshots * 1e6 << " us, restore " 
+		<< l / restores * 1e6 << " us" << std::endl;
+    }
+  }
+
+  if (selected("Memento checkpoint")){
+
+    using  namespace Behavioural_Patterns::Memento;
+
+    struct big_state { int cells[1 << 22]; };   // 16MB
+    const std::size_t updates = 50000000;
+    const char * path = "bench.checkpoint";
+    std::remove(path);
+
+    // the state is what a long run of updates leaves behind
+    auto rebuild = [&](big_state & s){
+      std::memset(static_cast<void *>(&s), 0, sizeof(big_state));
+      for (std::size_t i = 0; i < updates; ++i)
+	s.cells[(i * 2654435761u) & ((1 << 22) - 1)] += i;
+    };
+
+    std::unique_ptr<big_state> s(new big_state()), r(new big_state());
+    rebuild(*s);
+
+    {
+      memento_checkpoint<big_state> file(path);
+      std::size_t pages = 0;
+      double f = seconds([&] { pages = file.checkpoint(*s); });
+      std::cout << "\tfirst checkpoint " << pages << " pages in " 
+		<< f * 1e3 << " ms" << std::endl;
+
+      file.checkpoint(*s);   // both slots hold the state now
+
+      // the same 100 pages changed before each checkpoint, so each
+      // writes only those: its slot missed the two last rounds
+      const int rounds = 10;
+      double t = seconds([&] { for (int k = 0; k < rounds; ++k){
+				 for (std::size_t i = 0; i < 100; ++i)
+				   s->cells[i * 4099] += 1;
+				 pages = file.checkpoint(*s);
+			       } });
+      std::cout << "\tincremental checkpoint " << pages << " pages in " 
+		<< t / rounds * 1e3 << " ms" << std::endl;
+    }
+
+    double replay = seconds([&] { rebuild(*r); });
+    long sum = 0;
+    double mapped = seconds([&] { memento_checkpoint<big_state> file(path);
+				  sum = file.view()->cells[12345]; });
+    double copied = seconds([&] { memento_checkpoint<big_state> file(path);
+				  file.restore(*r); });
+
+    std::cout << "\trestart by replaying " << updates << " updates " 
+	      << replay * 1e3 << " ms" << std::endl
+	      << "\trestart by mapping the checkpoint " << mapped * 1e3 
+	      << " ms, restoring a copy " << copied * 1e3 << " ms" 
+	      << " (cell " << sum << ")" << std::endl;
+    std::remove(path);
+  }
+
+  if (selected("Observer scaling")){
+
+    using  namespace Behavioural_Patterns::Observer;
+
+    const std::size_t per_thread = 2000000;
+    std::vector<quiet_observer> observers(8);
+    quiet_observer churn;
+
+    // publishers notify while another thread attaches and detaches
+    auto run = [&](auto & s, std::size_t threads){
+      for (std::size_t i = 0; i < observers.size(); ++i)
+	s.attach(&observers[i]);
+      std::atomic<bool> done(false);
+      std::thread subscriber([&] { while (!done){ 
+	    s.attach(&churn); 
+	    s.detach(&churn); 
+	    std::this_thread::sleep_for(std::chrono::microseconds(100));
+	  } });
+      double t = seconds([&] {
+	  std::vector<std::thread> publishers;
+	  for (std::size_t p = 0; p < threads; ++p)
+	    publishers.emplace_back([&] { for (std::size_t i = 0; i < per_thread; ++i)
+					    s.set_value(i); });
+	  for (std::size_t p = 0; p < threads; ++p)
+	    publishers[p].join();
+	});
+      done = true;
+      subscriber.join();
+      return t;
+    };
+
+    std::cout << "\t" << observers.size() << " observers, " 
+	      << std::thread::hardware_concurrency() << " cores" << std::endl;
+    for (std::size_t threads : { 1, 2, 4, 8 }){
+      std::cout << "\t" << threads << " publishers" << std::endl;
+      locked_subject l;
+      report("mutex", double(per_thread) * threads, run(l, threads), 
+	     "notifies");
+      subject s;
+      report("read-copy-update", double(per_thread) * threads, 
+	     run(s, threads), "notifies");
+    }
+  }
+
+  if (selected("Observer topics")){
+
+    using  namespace Behavioural_Patterns::Observer;
+
+    const std::size_t n = 10000, topics = 1000, interests = 2;
+    const std::size_t changes = 200000;
+    std::vector<quiet_observer> observers(n);
+    std::mt19937 rng(3);
+
+    std::vector<observer *> all;
+    std::vector<std::pair<observer *, topic> > interested;
+    for (std::size_t i = 0; i < n; ++i){
+      all.push_back(&observers[i]);
+      for (std::size_t k = 0; k < interests; ++k)
+	interested.emplace_back(&observers[i], rng() % topics);
+    }
+
+    std::cout << "\t" << n << " observers, " << interests << " of " 
+	      << topics << " topics each" << std::endl;
+
+    subject everyone, indexed;
+    double one = seconds([&] { subject s;
+			       for (std::size_t i = 0; i < interested.size(); ++i)
+				 s.attach(interested[i].first, 
+					  interested[i].second); });
+    report("attach one at a time", interested.size(), one, "observers");
+    double batch = seconds([&] { everyone.attach(all);
+				 indexed.attach(interested); });
+    report("attach in one batch", all.size() + interested.size(), batch, 
+	   "observers");
+    double a = seconds([&] { for (std::size_t i = 0; i < changes / 100; ++i)
+			       everyone.set_value(i); });
+    report("every observer", changes / 100, a, "changes");
+    double t = seconds([&] { for (std::size_t i = 0; i < changes; ++i)
+			       indexed.set_value(rng() % topics, i); });
+    report("topic index", changes, t, "changes");
+  }
+
+  if (selected("State transitions")){
+
+    using  namespace Behavioural_Patterns::State;
+
+    const std::size_t n = 10000000;
+
+    std::vector<press> events(n);
+    std::mt19937 rng(5);
+    for (std::size_t i = 0; i < n; ++i)
+      events[i] = rng() & 1 ? press::ON : press::OFF;
+
+    tool t;
+    t.set_current(new OFF());
+    double o = seconds([&] { for (std::size_t i = 0; i < n; ++i)
+			       if (events[i] == press::ON)
+				 t.on();
+			       else
+				 t.off(); });
+
+    switch_counts counts;
+    switch_machine m(counts, power::OFF);
+    double f = seconds([&] { for (std::size_t i = 0; i < n; ++i)
+			       m.fire(events[i]); });
+
+    report("tool, state objects", n, o, "transitions");
+    report("switch_machine, table", n, f, "transitions");
+    std::cout << "\t(" << counts.on + counts.off << " state changes)" 
+	      << std::endl;
+  }
+
+  if (selected("State machines batched")){
+
+    using  namespace Behavioural_Patterns::State;
+
+    const std::size_t n = 10000000, rounds = 10;
+    std::vector<press> events(n);
+    std::mt19937 rng(9);
+    for (std::size_t i = 0; i < n; ++i)
+      events[i] = rng() & 1 ? press::ON : press::OFF;
+
+    {
+      std::vector<tool> tools(n);
+      for (std::size_t i = 0; i < n; ++i)
+	tools[i].set_current(new OFF());
+      double v = seconds([&] { for (std::size_t i = 0; i < n; ++i)
+				 if (events[i] == press::ON)
+				   tools[i].on();
+				 else
+				   tools[i].off(); });
+      std::cout << "\t" << n << " instances" << std::endl;
+      report("tool objects, virtual", n, v, "transitions");
+    }
+
+    {
+      std::vector<switch_counts> counts(n);
+      std::vector<switch_machine> machines;
+      machines.reserve(n);
+      for (std::size_t i = 0; i < n; ++i)
+	machines.emplace_back(counts[i], power::OFF);
+      double t = seconds([&] { for (std::size_t r = 0; r < rounds; ++r)
+				 for (std::size_t i = 0; i < n; ++i)
+				   machines[i].fire(events[i]); });
+      report("switch_machine objects, table", double(n) * rounds, t, 
+	     "transitions");
+    }
+
+    switch_machines many(n, power::OFF);
+    for (unsigned int threads : { 1u, 2u, 4u }){
+      double b = seconds([&] { for (std::size_t r = 0; r < rounds; ++r)
+				 many.fire(events, threads); });
+      std::cout << "\tswitch_machines, " << threads << " threads" << std::endl;
+      report("batched", double(n) * rounds, b, "transitions");
+    }
+  }
+
+  if (selected("Strategy adaptive")){
+
+    using  namespace Behavioural_Patterns::Strategy;
+
+    struct work{
+      const std::vector<int> * input;
+      std::vector<int> sorted;
+    };
+
+    auto insertion = [](work & w){
+      w.sorted.assign(w.input->begin(), w.input->end());
+      std::vector<int> & v = w.sorted;
+      for (std::size_t i = 1; i < v.size(); ++i){
+	int x = v[i];
+	std::size_t j = i;
+	for (; j && v[j - 1] > x; --j)
+	  v[j] = v[j - 1];
+	v[j] = x;
+      }
+    };
+    auto introsort = [](work & w){
+      w.sorted.assign(w.input->begin(), w.input->end());
+      std::sort(w.sorted.begin(), w.sorted.end());
+    };
+    auto heap = [](work & w){
+      w.sorted.assign(w.input->begin(), w.input->end());
+      std::make_heap(w.sorted.begin(), w.sorted.end());
+      std::sort_heap(w.sorted.begin(), w.sorted.end());
+    };
+
+    adaptive_strategy<work> sorter;
+    sorter.add("insertion sort", insertion);
+    sorter.add("std::sort", introsort);
+    sorter.add("heap sort", heap);
+
+    std::mt19937 rng(11);
+    std::vector<std::vector<int> > inputs;
+    for (std::size_t i = 0; i < 20000; ++i){
+      std::size_t size = 1 + (rng() % 2 ? rng() % 32 : rng() % 1024);
+      inputs.push_back(std::vector<int>(size));
+      for (std::size_t k = 0; k < size; ++k)
+	inputs.back()[k] = rng();
+    }
+
+    auto run = [&](auto && f){ work w; 
+      return seconds([&] { for (std::size_t i = 0; i < inputs.size(); ++i){
+	    w.input = &inputs[i];
+	    f(w);
+	  } }); };
+
+    report("always insertion sort", inputs.size(), run(insertion), "calls");
+    report("always std::sort", inputs.size(), run(introsort), "calls");
+    report("always heap sort", inputs.size(), run(heap), "calls");
+    report("adaptive", inputs.size(), 
+	   run([&](work & w) { sorter.run(w, w.input->size()); }), "calls");
+
+    for (const auto & d : sorter.decisions()){
+      std::cout << "\tsizes below " << (1ul << d.bucket) << ": " 
+		<< sorter.name(d.best) << " (";
+      for (std::size_t c = 0; c < d.calls.size(); ++c)
+	std::cout << (c ? ", " : "") << d.calls[c] << " calls " 
+		  << std::size_t(d.mean_ns[c]) << " ns";
+      std::cout << ")" << std::endl;
+    }
+  }
+
+  if (selected("Visitor dispatch")){
+
+    using  namespace Behavioural_Patterns::Visitor;
+
+    const std::size_t n = 10000000;
+    const A a; const B b; const C c;      // the rest are silent copies
+    Parent p;
+
+    for (std::size_t i = 0; i < p.getElements().size(); ++i)
+      delete p.getElements()[i];          // its own three elements
+    p.getElements().clear();
+    flat_parent flat(n);
+    sorted_parent sorted;
+    std::mt19937 rng(13);
+    for (std::size_t i = 0; i < n; ++i)
+      switch (rng() % 3){
+      case 0: p.getElements().push_back(new A(a)); flat.add(a); sorted.add(a); 
+	break;
+      case 1: p.getElements().push_back(new B(b)); flat.add(b); sorted.add(b); 
+	break;
+      default: p.getElements().push_back(new C(c)); flat.add(c); sorted.add(c);
+      }
+
+    // every visit reads the element, so that no loop folds into a count
+    counting_visitor v;
+    std::size_t na = 0, nb = 0, nc = 0;
+    auto count = overloaded{ 
+      [&](A & e) { na += counting_visitor::touch(e); }, 
+      [&](B & e) { nb += counting_visitor::touch(e); }, 
+      [&](C & e) { nc += counting_visitor::touch(e); } };
+    auto check = [&](std::size_t x, std::size_t y, std::size_t z){
+      if (x != v.a || y != v.b || z != v.c)
+	std::cout << "\tmismatch!" << std::endl;
+      na = nb = nc = 0;
+    };
+
+    report("Parent, double dispatch", n, seconds([&] { v.visit(p); }), 
+	   "visits");
+    report("flat_parent, std::visit", n, 
+	   seconds([&] { flat.visit(count); }), "visits");
+    check(na, nb, nc);
+    report("sorted_parent, per type loops", n, 
+	   seconds([&] { sorted.visit(count); }), "visits");
+    check(na, nb, nc);
+    counting_visitor w;
+    report("flat_parent, virtual visitor", n, 
+	   seconds([&] { flat.accept(w); }), "visits");
+    check(w.a, w.b, w.c);
+  }
+
+  if (selected("Visitor parallel")){
+
+    using  namespace Behavioural_Patterns::Visitor;
+
+    const std::size_t n = 20000000, rounds = 5;
+    const A a; const B b; const C c;
+    Parent p;
+
+    std::mt19937 rng(17);
+    for (std::size_t i = 0; i < n; ++i)
+      switch (rng() % 3){
+      case 0: p.getElements().push_back(new A(a)); break;
+      case 1: p.getElements().push_back(new B(b)); break;
+      default: p.getElements().push_back(new C(c));
+      }
+
+    counting_visitor serial;
+    double s = seconds([&] { for (std::size_t r = 0; r < rounds; ++r)
+			       serial.visit(p); });
+    std::cout << "\t" << p.getElements().size() << " elements, " 
+	      << std::thread::hardware_concurrency() << " cores" << std::endl;
+    report("serial", double(n) * rounds, s, "visits");
+
+    for (unsigned int threads : { 1u, 2u, 4u, 8u }){
+      visit_pool pool(threads);
+      counting_visitor v;
+      double t = seconds([&] { for (std::size_t r = 0; r < rounds; ++r)
+				 parallel_visit(p, v, pool); });
+      if (v.a != serial.a || v.b != serial.b || v.c != serial.c)
+	std::cout << "\tmismatch!" << std::endl;
+      std::cout << "\t" << threads << " workers" << std::endl;
+      report("parallel_visit", double(n) * rounds, t, "visits");
+    }
+  }
+
+  if (selected("Interpreter")){
+
+    using  namespace Behavioural_Patterns::Interpreter;
+
+    const std::size_t n = 10000000;
+    const char * rules[] = {
+      "price * qty > 100 && !(region == 3) ? price * qty * (1 - 0.1) : 0",
+      "(a + b) * (a + b) - (a - b) * (a - b) > 4 * 2 * c",
+      "x * x + y * y < 1 || (x > 0.5 && y > 0.5) || x * x + y * y > 4 * 4",
+      "rate * 365 / 100 * (1 + 0 * years) + 2 * 3 - 6" };
+
+    std::mt19937 rng(19);
+    std::uniform_real_distribution<double> u(-10, 10);
+    std::vector<double> vars(4 * 1024);
+    for (std::size_t i = 0; i < vars.size(); ++i)
+      vars[i] = u(rng);
+
+    for (const char * text : rules){
+      syntax_tree tree(text);
+      program p = tree.compile();
+      double sum_tree = 0, sum_program = 0;
+      std::cout << "\t" << text << std::endl;
+      report("tree walking", n, seconds([&] { 
+	    for (std::size_t i = 0; i < n; ++i)
+	      sum_tree += tree.interpret(&vars[i % 1024 * 4]); }), "evals");
+      report("bytecode", n, seconds([&] { 
+	    for (std::size_t i = 0; i < n; ++i)
+	      sum_program += p.run(&vars[i % 1024 * 4]); }), "evals");
+      std::cout << "\t(" << p.code().size() << " instructions" 
+		<< (sum_tree == sum_program ? "" : ", mismatch!") << ")" 
+		<< std::endl;
+    }
+  }
+
+  if (selected("Interpreter columns")){
+
+    using  namespace Behavioural_Patterns::Interpreter;
+
+    const std::size_t n = 4000000;
+    const char * rules[] = {
+      "price * qty > 100 && !(region == 3) ? price * qty * (1 - 0.1) : 0",
+      "(a + b) * (a + b) - (a - b) * (a - b) > 4 * 2 * c",
+      "x * x + y * y < 1 || (x > 0.5 && y > 0.5) || x * x + y * y > 4 * 4" };
+
+    std::mt19937 rng(23);
+    std::uniform_real_distribution<double> u(-10, 10);
+    std::vector<std::vector<double> > columns(4, std::vector<double>(n));
+    for (std::size_t c = 0; c < columns.size(); ++c)
+      for (std::size_t i = 0; i < n; ++i)
+	columns[c][i] = u(rng);
+
+    for (const char * text : rules){
+      program p = syntax_tree(text).compile();
+      const std::size_t vars = p.variables().size();
+      std::vector<const double *> from(vars);
+      for (std::size_t v = 0; v < vars; ++v)
+	from[v] = columns[v].data();
+      std::vector<double> by_row(n), by_column(n);
+
+      std::cout << "\t" << text << std::endl;
+      report("row at a time", n, seconds([&] { 
+	    double row[8];
+	    for (std::size_t i = 0; i < n; ++i){
+	      for (std::size_t v = 0; v < vars; ++v)
+		row[v] = from[v][i];
+	      by_row[i] = p.run(row);
+	    } }), "rows");
+      report("columns, by chunk", n, 
+	     seconds([&] { p.run(from, by_column); }), "rows");
+      if (by_row != by_column)
+	std::cout << "\tmismatch!" << std::endl;
+    }
+  }
+
+  if (selected("Interpreter cache")){
+
+    using  namespace Behavioural_Patterns::Interpreter;
+
+    const std::size_t distinct = 2000, loads = 200000;
+    const char * shapes[] = { 
+      "price * qty > %d && !(region == %d) ? price * qty * 0.9 : 0",
+      "(a + b) * (a + b) - (a - b)*(a - b) > %d * c || d == %d",
+      "x * x + y * y < %d || (x > 0.5 && y > 0.5) || x > %d" };
+
+    // tenants load the same rules, written with different spacing
+    std::mt19937 rng(29);
+    std::vector<std::string> texts(loads);
+    for (std::size_t i = 0; i < loads; ++i){
+      std::size_t rule = std::min({ rng() % distinct, rng() % distinct, 
+				    rng() % distinct });
+      char text[128];
+      std::snprintf(text, sizeof(text), shapes[rule % 3], 
+		    int(rule), int(rule / 3));
+      texts[i] = text;
+      if (rng() % 2)
+	texts[i].erase(std::remove(texts[i].begin(), texts[i].end(), ' '), 
+		       texts[i].end());
+    }
+
+    for (unsigned int threads : { 1u, 4u }){
+      auto run = [&](auto load){
+	return seconds([&] {
+	    std::vector<std::thread> workers;
+	    for (unsigned int w = 0; w < threads; ++w)
+	      workers.emplace_back([&, w] { 
+		  for (std::size_t i = w; i < loads; i += threads)
+		    load(texts[i]); });
+	    for (unsigned int w = 0; w < threads; ++w)
+	      workers[w].join();
+	  });
+      };
+      std::cout << "\t" << threads << " threads" << std::endl;
+      report("compile every load", loads, run([](const std::string & t) { 
+	    syntax_tree(t).compile(); }), "loads");
+      program_cache cache(1024);
+      report("program_cache", loads, run([&](const std::string & t) { 
+	    cache.get(t); }), "loads");
+      program_cache::cache_stats st = cache.stats();
+      std::cout << "\thit rate " << st.hit_rate << ", " << st.evictions 
+		<< " evictions, compiling took " 
+		<< std::chrono::duration<double>(st.compile_time).count() 
+		<< " s and saved " 
+		<< std::chrono::duration<double>(st.saved).count() << " s" 
+		<< std::endl;
+    }
+  }
+}
+
+// the demo paths of test.cpp that talk the most, each round about
+// fifteen lines
+
+static void demo_paths(std::size_t rounds)
+{
+  using  namespace Creational_Patterns::Abstract_Factory;
+  using  namespace Structural_Patterns::Flyweight;
+  using  namespace Structural_Patterns::Proxy;
+  namespace chain = Behavioural_Patterns::Chain_Of_Responsability;
+  namespace observer = Behavioural_Patterns::Observer;
+
+  OSX_Button osx;
+  Windows_Button windows;
+  chain::H1 root(1), h1(2);
+  chain::H2 h2(3);
+  root.add(&h1);
+  root.add(&h2);
+  observer::a_observer a;
+  observer::b_observer b;
+  observer::subject s;
+  s.attach(&a);
+  s.attach(&b);
+
+  for (std::size_t r = 0; r < rounds; ++r){
+    osx.draw();
+    windows.draw();
+    FlyweightFactory::getIcon(r % 4);
+    ImageProxy image(r);
+    image.draw();
+    root.handle(3);
+    s.set_value(r);
+  }
+}
+
+void logging(){
+
+  if (selected("Logging demo paths")){
+
+    using  namespace Structural_Patterns::Flyweight;
+
+    const std::size_t rounds = 50000;
+    for (unsigned int i = 0; i < 4; ++i)  // created once, only read after
+      FlyweightFactory::getIcon(i);
+
+    for (unsigned int threads : { 1u, 4u }){
+      auto run = [&]{ 
+	return seconds([&] {
+	    std::vector<std::thread> workers;
+	    for (unsigned int w = 0; w < threads; ++w)
+	      workers.emplace_back([&] { demo_paths(rounds); });
+	    for (unsigned int w = 0; w < threads; ++w)
+	      workers[w].join();
+	    Logging::flush();
+	  });
+      };
+      std::cout << "\t" << threads << " threads" << std::endl;
+#if defined(DESIGN_PATTERNS_NO_LOG)
+      report("off, compiled out", double(rounds) * threads, run(), "rounds");
+#else
+      Logging::set_mode(Logging::mode::ASYNC);
+      report("async", double(rounds) * threads, run(), "rounds");
+      Logging::set_mode(Logging::mode::SYNC);
+      report("sync", double(rounds) * threads, run(), "rounds");
+      Logging::set_mode(Logging::mode::ASYNC);
+#endif
+    }
+  }
+}
+
+int main(int argc, char ** argv){
+
+  if (argc > 1)
+    filter_ = argv[1];
+
+  std::ofstream null("/dev/null");      // what the patterns say
+  Logging::set_output(null);
+  logging();
+  behavioural();
+  Logging::set_output(std::cout);
+}
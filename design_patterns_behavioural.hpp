@@ -1,7 +1,54 @@
 #ifndef DESIGN_PATTERNS_BEHAVIOURAL_
 #define DESIGN_PATTERNS_BEHAVIOURAL_
 
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+#if defined(__SSSE3__)
+#include<immintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include<x86intrin.h>
+#endif
+
+#include<algorithm>
+#include<atomic>
+#include<bit>
+#include<cctype>
+#include<cerrno>
+#include<charconv>
+#include<cmath>
+#include<chrono>
+#include<concepts>
+#include<condition_variable>
+#include<cstddef>
+#include<cstdint>
+#include<cstring>
+#include<deque>
+#include<exception>
+#include<functional>
 #include<list>
+#include<memory>
+#include<mutex>
+#include<new>
+#include<ostream>
+#include<ranges>
+#include<span>
+#include<stdexcept>
+#include<string>
+#include<string_view>
+#include<system_error>
+#include<thread>
+#include<tuple>
+#include<type_traits>
+#include<unordered_map>
+#include<utility>
+#include<variant>
+#include<vector>
+
+#include "design_patterns_log.hpp"
 
 namespace Behavioural_Patterns{
 
@@ -13,7 +60,8 @@ namespace Behavioural_Patterns{
     class Base
     {
     public :
-      Base(unsigned int name) :  name_(name), next_(0) {};
+      Base(unsigned int name) :  name_(name), next_(0), 
+				 handled_(0), passed_(0) {};
       void add(Base* n)  // add to the chain
       { 
 	if (next_)
@@ -22,19 +70,69 @@ namespace Behavioural_Patterns{
       }
       void setPointer(Base * p) { next_ = p; }
       
+      // handle the request at this link only, 
+      // true if this is the one
+      bool try_handle(unsigned int who){
+
+	if (who != name_)
+	  return false;
+	PATTERN_LOG("\t" << name_ << " is the one");
+	return true;
+      }
+
       virtual void handle(unsigned int who){
 	
-	if (who == name_)
-	  std::cout << "\t" << name_ << " is the one" << std::endl;
+	try_handle(who);
 	if (next_)
 	  next_->handle(who);
       }
+
+      // handle the whole batch at this link, compacting the 
+      // unhandled requests to the front; returns how many are left
+      virtual std::size_t handle_here(std::span<unsigned int> who)
+      { return partition(*this, who); }
+
+      // as handle_here, also counting handled and passed on
+      std::size_t process_batch(std::span<unsigned int> who){
+
+	std::size_t left = handle_here(who);
+	handled_ += who.size() - left;
+	passed_ += left;
+	return left;
+      }
+
+      // each link processes the batch before passing the unhandled
+      // remainder to the next, so its code and data stay hot.
+      // The remaining requests are left at the front of who.
+      std::size_t handle_batch(std::span<unsigned int> who){
+
+	for (Base * b = this; b && !who.empty(); b = b->next_)
+	  who = who.first(b->process_batch(who));
+	return who.size();
+      }
+
+      unsigned long handled() const { return handled_; }
+      unsigned long passed() const { return passed_; }
+      void reset_counters() { handled_ = passed_ = 0; }
       
     protected:
       unsigned int name_;
 
+      // run the try_handle of H over the batch, keeping the misses
+      template <typename H>
+      static std::size_t partition(H& h, std::span<unsigned int> who){
+
+	std::size_t left = 0;
+	for (unsigned int w : who)
+	  if (!h.H::try_handle(w))
+	    who[left++] = w;
+	return left;
+      }
+
     private:
       Base * next_;
+      unsigned long handled_;
+      unsigned long passed_;
     };
 
     class H1 : public Base{
@@ -42,10 +140,18 @@ namespace Behavioural_Patterns{
     public:
       H1(unsigned int name) : Base(name) {  };
 
+      bool try_handle(unsigned int who){
+	PATTERN_LOG("\tHandler H1");
+	return Base::try_handle(who);
+      }
+
       void handle(unsigned int who){
-	std::cout << "\tHandler H1" << std::endl;
+	PATTERN_LOG("\tHandler H1");
 	Base::handle(who);
       }
+
+      std::size_t handle_here(std::span<unsigned int> who)
+      { return partition(*this, who); }
     };
 
     class H2 : public Base{
@@ -53,10 +159,67 @@ namespace Behavioural_Patterns{
     public:
       H2(unsigned int name) : Base(name) {  };
 
+      bool try_handle(unsigned int who){
+	PATTERN_LOG("\tHandler H2");
+	return Base::try_handle(who);
+      }
+
       void handle(unsigned int who){
-	std::cout << "\tHandler H2" << std::endl;
+	PATTERN_LOG("\tHandler H2");
 	Base::handle(who);
       }
+
+      std::size_t handle_here(std::span<unsigned int> who)
+      { return partition(*this, who); }
+    };
+
+    // The chain fixed at compile time: handlers are held by value 
+    // and their try_handle() is bound statically, so the sequence
+    // inlines into straight-line code stopping at the first one 
+    // handling the request. Unhandled requests fall back to a 
+    // runtime chain of Base.
+
+    template <typename... Handlers>
+    class StaticChain{
+
+    public:
+      StaticChain(Handlers... h) : handlers_(h...), next_(0) {};
+
+      void add(Base* n)  // add to the dynamic tail
+      {
+	if (next_)
+	  n->setPointer(next_);
+	next_ = n;
+      }
+
+      bool handle(unsigned int who){
+
+	bool handled = std::apply([who](Handlers&... h)
+				  { return (h.Handlers::try_handle(who) || ...); },
+				  handlers_);
+	if (!handled && next_)
+	  next_->handle(who);
+	return handled;
+      }
+
+      // batch form: each handler in turn takes the whole remainder
+      std::size_t handle_batch(std::span<unsigned int> who){
+
+	std::apply([&who](Handlers&... h)
+		   { ((who = who.first(h.process_batch(who))), ...); },
+		   handlers_);
+	if (next_ && !who.empty())
+	  return next_->handle_batch(who);
+	return who.size();
+      }
+
+      // the I-th static handler, with its handled and passed counters
+      template <std::size_t I>
+      const auto & handler() const { return std::get<I>(handlers_); }
+
+    private:
+      std::tuple<Handlers...> handlers_;
+      Base * next_;
     };
   }; // end Chain_Of_Responsability
 
@@ -71,8 +234,8 @@ namespace Behavioural_Patterns{
     public:
       void client_function(int param){ // client method
 
-	std::cout << "\tcalled client function with param " 
-		  << param << std::endl;
+	PATTERN_LOG("\tcalled client function with param " 
+		    << param);
       };
     };
     
@@ -99,487 +262,3854 @@ namespace Behavioural_Patterns{
       // invoke the action callback registered
       void execute(int what)
       { (receiver_->*action_)(what); };  
-    };
-
-  }; // end command
-
-  
-  namespace Iterator{
-
-    // An aggregate object such as a list should give you 
-    // a way to access its elements without exposing its 
-    // internal structure. 
 
-    class stack
-    {
-    private:
-      int items_[100];  // should be dynamic
-      int sp_;          // current item           
-
-    public:
-      friend class iterator; // friend it to access iterator
-      stack() { sp_ = -1; }
-      
-      void push(int in) { items_[++sp_] = in; }
-      int pop() { return items_[sp_--]; }
-      bool isEmpty() { return (sp_ == -1); }
+      // serialize the command and its argument into a journal
+      template <typename Journal>
+      void record(Journal & j, int what) const
+      { j.append(receiver_, action_, what); }
     };
 
-    class iterator{
+    // A command by value: any callable taking the int argument, 
+    // with its bound arguments, is stored in an inline buffer of 
+    // InlineSize bytes, and only oversize callables go to the heap.
+    // Callables that are trivially copyable, as well as the ones on
+    // the heap, are relocated by a plain memcpy of the buffer.
+    // Move-only callables are accepted; copying a command holding one
+    // throws std::logic_error, executing an empty one throws
+    // std::bad_function_call.
 
-    private:
-      const stack &stk_;  // access the structure
-      int index_;
+    template <std::size_t InlineSize = 3 * sizeof(void *)>
+    class small_command{
 
     public:
-      iterator(const stack &s) : stk_(s), index_(0)
-      {}      // initialize the iterator
-      
-      void operator++() 
-      { ++index_; }
+      small_command() : ops_(0) {};
 
-      int operator()()  // get the end of structure
-      { return index_ != stk_.sp_ +1 ;}
+      template <typename F, typename = std::enable_if_t
+		<!std::is_same_v<std::decay_t<F>, small_command>>>
+      small_command(F && f) : ops_(&ops_for<std::decay_t<F>>::table)
+      { 
+	typedef std::decay_t<F> T;
+	if constexpr (fits<T>())
+	  new (buffer_) T(std::forward<F>(f));
+	else
+	  new (buffer_) T *(new T(std::forward<F>(f)));
+      }
 
-      int operator *()
-      { return stk_.items_[index_]; }
-    }; 
+      // same binding as a_specific_command, without the allocation
+      template <typename R>
+      small_command(R * receiver, void (R::*a)(int)) : 
+	small_command(bound<R>{ receiver, a }) {};
 
-    bool operator == (const stack &s1, 
-		      const stack &s2)
-    {
-      iterator it1(s1), it2(s2);
+      small_command(const small_command & o) : ops_(o.ops_)
+      { if (ops_) ops_->copy(buffer_, o.buffer_); }
 
-      for (; it1(); ++it1, ++it2)
-	if (*it1 != *it2)
-	  return false;
-      
-      return true;
-    }
-  }; // end Iterator
+      small_command(small_command && o) noexcept : ops_(o.ops_)
+      { relocate(o); }
 
+      small_command & operator=(const small_command & o)
+      { 
+	if (this != &o){
+	  small_command tmp(o);
+	  *this = std::move(tmp);
+	}
+	return *this;
+      }
 
-  namespace Mediator{
+      small_command & operator=(small_command && o) noexcept
+      { 
+	if (this != &o){
+	  reset();
+	  ops_ = o.ops_;
+	  relocate(o);
+	}
+	return *this;
+      }
 
-    // Define an object that encapsulates how a set of objects interact. 
-    // promotes loose coupling
+      ~small_command() { reset(); }
 
-    // Quite general design pattern
-    // for example a list is mediating between node objects
+      void execute(int what) 
+      { 
+	if (!ops_)
+	  throw std::bad_function_call();
+	ops_->invoke(buffer_, what); 
+      }
+      explicit operator bool() const { return ops_ != 0; }
 
-    class node {
+      // true when the callable is held in the inline buffer
+      bool is_inline() const { return ops_ && ops_->inline_; }
 
     private:
-      int v_;
+      template <typename R>
+      struct bound{
+	R * receiver_;
+	void (R::*action_)(int);
+	void operator()(int what) { (receiver_->*action_)(what); }
+      };
 
-    public:
-      node (int v) : v_(v){};
-      int getValue() { return v_; }
-    };
+      struct ops{
+	void (*invoke)(void * buf, int what);
+	void (*copy)(void * dst, const void * src);
+	void (*move)(void * dst, void * src);  // null: memcpy is enough
+	void (*destroy)(void * buf);           // null: nothing to do
+	bool inline_;
+      };
 
-    class list { // mediating nodes
+      [[noreturn]] static void move_only()
+      { throw std::logic_error("small_command: the callable is move-only"); }
 
-    private:
-      std::vector<node *> values_;
-      typedef std::vector<node *>::const_iterator const_it;
-  
-    public:
-      void add(node *n){ values_.push_back(n);}
-      void traverse() 
-      { const_it it1 = values_.begin();
-	const_it it2 = values_.end();
-	for (; it1 != it2; it1++)
-	  std::cout << " " << (*it1)->getValue();
-	std::cout << std::endl;
+      template <typename T>
+      static constexpr bool fits()
+      { 
+	return sizeof(T) <= InlineSize && 
+	  alignof(T) <= alignof(void *) &&
+	  std::is_nothrow_move_constructible_v<T>;
       }
-    };
 
-  }; // end mediator
+      template <typename T, bool Inline = fits<T>()>
+      struct ops_for{
+	static T & get(void * b) { return *std::launder(static_cast<T *>(b)); }
+	static void invoke(void * b, int what) { get(b)(what); }
+	static void copy(void * d, const void * s) 
+	{ 
+	  if constexpr (std::is_copy_constructible_v<T>)
+	    new (d) T(get(const_cast<void *>(s))); 
+	  else
+	    move_only();
+	}
+	static void move(void * d, void * s) 
+	{ new (d) T(std::move(get(s))); get(s).~T(); }
+	static void destroy(void * b) { get(b).~T(); }
+	static constexpr bool trivial = std::is_trivially_copyable_v<T>;
+	static constexpr ops table = { invoke, copy, trivial ? 0 : move, 
+				       trivial ? 0 : destroy, true };
+      };
 
-  namespace Memento{
+      template <typename T>
+      struct ops_for<T, false>{
+	static T * get(void * b) { return *std::launder(static_cast<T **>(b)); }
+	static void invoke(void * b, int what) { (*get(b))(what); }
+	static void copy(void * d, const void * s) 
+	{ 
+	  if constexpr (std::is_copy_constructible_v<T>)
+	    new (d) T *(new T(*get(const_cast<void *>(s)))); 
+	  else
+	    move_only();
+	}
+	static void destroy(void * b) { delete get(b); }
+	static constexpr ops table = { invoke, copy, 0, destroy, false };
+      };
 
-    // The client requests a Memento from the source object 
-    // when it needs to checkpoint the source object's state
-    // If the client subsequently needs to "rollback" the 
-    // source object's state, it hands the Memento back to 
-    // the source object for reinstatement.
+      void relocate(small_command & o)
+      {
+	if (ops_){
+	  if (ops_->move)
+	    ops_->move(buffer_, o.buffer_);
+	  else
+	    std::memcpy(buffer_, o.buffer_, InlineSize);
+	}
+	o.ops_ = 0;
+      }
 
-    class memento{ // memento
+      void reset()
+      {
+	if (ops_ && ops_->destroy)
+	  ops_->destroy(buffer_);
+	ops_ = 0;
+      }
 
-    public:
-      memento(int val) : value_(val) {};
-      
-    private:
-      friend class client;
-      int value_;
+      static_assert(InlineSize >= sizeof(void *), 
+		    "the buffer holds at least a pointer");
+
+      const ops * ops_;
+      alignas(void *) unsigned char buffer_[InlineSize];
     };
-    
-    class client{ // client
-      
+
+    // log-linear histogram of values (e.g. nanoseconds), 8 buckets
+    // per power of two; recording is a relaxed atomic increment
+
+    class log_histogram{
+
     public:
-      client(int value) : value_(value) {};
-      void increment() { ++value_; } // change of state;
-      int get_value() { return value_; }
+      void record(std::uint64_t v)
+      { counts_[index(v)].fetch_add(1, std::memory_order_relaxed); }
 
-      memento * create_memento() { return new memento(value_) ; }
-      void restore_from_memento(memento * m) { value_ = m->value_; }
-      
-    private:
-      int value_;
+      std::uint64_t count() const
+      {
+	std::uint64_t n = 0;
+	for (const auto & c : counts_)
+	  n += c.load(std::memory_order_relaxed);
+	return n;
+      }
 
-    };
+      // upper bound of the bucket holding the p-th quantile, p in [0,1]
+      std::uint64_t percentile(double p) const
+      {
+	std::uint64_t total = count(), seen = 0;
+	if (!total)
+	  return 0;
+	std::uint64_t rank = std::max<std::uint64_t>(1, p * total + 0.5);
+	for (std::size_t i = 0; i < buckets_; ++i){
+	  seen += counts_[i].load(std::memory_order_relaxed);
+	  if (seen >= rank)
+	    return upper(i);
+	}
+	return upper(buckets_ - 1);
+      }
 
-  }; // end memento
+      void reset()
+      {
+	for (auto & c : counts_)
+	  c.store(0, std::memory_order_relaxed);
+      }
 
-  namespace Observer{
+    private:
+      static const std::size_t buckets_ = 62 * 8;
+      std::atomic<std::uint64_t> counts_[buckets_];
 
-    // when one object changes state, 
-    // all its dependents are notified and updated automatically.
-    
-    class observer{
+      static std::size_t index(std::uint64_t v)
+      {
+	if (v < 8)
+	  return v;
+	int msb = 63 - __builtin_clzll(v);
+	return (msb - 2) * 8 + ((v >> (msb - 3)) & 7);
+      }
 
-    public:
-      virtual void update(int value) = 0;
+      static std::uint64_t upper(std::size_t i)
+      {
+	if (i < 8)
+	  return i;
+	int shift = i / 8 - 1;
+	return ((8 + i % 8 + 1) << shift) - 1;
+      }
     };
 
-    class a_observer : public observer{
+    // Commands are enqueued from many producer threads and executed
+    // in order by a dedicated consumer thread. The queue is a bounded
+    // lock-free MPSC ring with a sequence number per cell: producers
+    // claim a cell with a CAS and copy the command inline in it, so 
+    // there is no allocation per command. The consumer drains up to
+    // batch commands at a time. When the ring is full, push() either
+    // waits for room (BLOCK) or drops the command (DROP). Once stop()
+    // is called nothing drains the ring any more: push() then returns
+    // false, also when it was waiting for room. Producers are expected
+    // to be done before stop(); a push racing with it may be lost.
+    // A command that throws is counted in failed(), the executor
+    // goes on with the next one.
+
+    template <std::size_t InlineSize = 32>
+    class command_queue{
 
     public:
-      void update(int value) 
-      { std::cout << "\ta seeing " << value << std::endl; }
-    };
+      enum overflow { BLOCK, DROP };
+
+      command_queue(std::size_t capacity = 1024, std::size_t batch = 64,
+		    overflow policy = BLOCK) :
+	mask_(std::bit_ceil(capacity) - 1), batch_(batch), 
+	policy_(policy), cells_(new cell[mask_ + 1]),
+	enqueue_pos_(0), dequeue_pos_(0), executed_(0), dropped_(0),
+	failed_(0), running_(true)
+      {
+	for (std::size_t i = 0; i <= mask_; ++i)
+	  cells_[i].seq.store(i, std::memory_order_relaxed);
+	executor_ = std::thread([this] { run(); });
+      }
 
-    class b_observer : public observer{
+      ~command_queue() { stop(); }
 
-    public:
-      void update(int value) 
-      { std::cout << "\tb seeing " << value << std::endl; }
-    };
+      command_queue(const command_queue &) = delete;
+      command_queue & operator=(const command_queue &) = delete;
 
-    class subject{
+      // copy c into the ring, to be executed later with what; false
+      // if it was dropped or the queue is stopped
+      template <typename Cmd>
+      bool push(const Cmd & c, int what)
+      {
+	static_assert(std::is_base_of_v<command, Cmd>, 
+		      "only commands can be queued");
+	static_assert(sizeof(Cmd) <= InlineSize && 
+		      alignof(Cmd) <= alignof(std::max_align_t),
+		      "command too large to be stored inline");
+	static_assert(std::is_trivially_destructible_v<Cmd>,
+		      "queued commands are never destroyed");
+
+	if (!running_.load(std::memory_order_acquire))
+	  return false;
+	std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+	cell * slot;
+	for (;;){
+	  slot = &cells_[pos & mask_];
+	  std::size_t seq = slot->seq.load(std::memory_order_acquire);
+	  std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+	  if (diff == 0){
+	    if (enqueue_pos_.compare_exchange_weak
+		(pos, pos + 1, std::memory_order_relaxed))
+	      break;
+	  }
+	  else if (diff < 0){      // full
+	    if (policy_ == DROP){
+	      dropped_.fetch_add(1, std::memory_order_relaxed);
+	      return false;
+	    }
+	    if (!running_.load(std::memory_order_acquire))
+	      return false;
+	    std::this_thread::yield();
+	    pos = enqueue_pos_.load(std::memory_order_relaxed);
+	  }
+	  else
+	    pos = enqueue_pos_.load(std::memory_order_relaxed);
+	}
 
-    private:
-      int value_;
-      std::vector<observer *>  observers_;
-      typedef std::vector<observer *>::const_iterator const_it;
+	slot->cmd = new (slot->storage) Cmd(c);
+	slot->what = what;
+	slot->stamp = now();
+	slot->seq.store(pos + 1, std::memory_order_release);
+	return true;
+      }
 
-    public:
-      void set_value(int value) { value_=value; notify(); }
+      // wait for the queued commands, then stop the executor
+      void stop()
+      {
+	if (!executor_.joinable())
+	  return;
+	running_.store(false, std::memory_order_release);
+	executor_.join();
+      }
 
-      // attach the observers
-      void attach(observer * o) { observers_.push_back(o); }
-      void notify()
+      // the dequeue position first: the enqueue one read after it is
+      // never behind it
+      std::size_t depth() const
       { 
-	const_it it = observers_.begin(), it_end = observers_.end();
-	for (; it != it_end; ++it)
-	  (*it)->update(value_);
+	const std::size_t d = dequeue_pos_.load(std::memory_order_acquire);
+	const std::size_t e = enqueue_pos_.load(std::memory_order_acquire);
+	return e > d ? e - d : 0;
       }
-    };
-  }; // end observer
-
-  namespace State {
-    
-    // Allow an object to alter its behavior when its 
-    // internal state changes. The object will appear 
-    // to change its class.
+      std::size_t capacity() const { return mask_ + 1; }
+      std::uint64_t executed() const { return executed_.load(); }
+      std::uint64_t dropped() const { return dropped_.load(); }
+      // commands whose execute() threw, counted in executed() too
+      std::uint64_t failed() const { return failed_.load(); }
 
-    class tool{
+      // enqueue->execute latency in nanoseconds
+      std::uint64_t latency_percentile(double p) const
+      { return latency_.percentile(p); }
 
     private:
-      class state * current_;
+      struct cell{
+	std::atomic<std::size_t> seq;
+	command * cmd;
+	int what;
+	std::uint64_t stamp;
+	alignas(std::max_align_t) unsigned char storage[InlineSize];
+      };
 
-    public:
-      void set_current (state * s) { current_=s; };
-      void on();
-      void off();
-    };
+      static std::uint64_t now()
+      {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>
+	  (std::chrono::steady_clock::now().time_since_epoch()).count();
+      }
 
-    class state{
+      // execute one batch, returns how many commands ran
+      std::size_t drain()
+      {
+	std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed), n;
+	for (n = 0; n < batch_; ++n, ++pos){
+	  cell & slot = cells_[pos & mask_];
+	  if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+	    break;
+	  try{
+	    slot.cmd->execute(slot.what);
+	  }
+	  catch (...){       // the executor carries on
+	    failed_.fetch_add(1, std::memory_order_relaxed);
+	  }
+	  latency_.record(now() - slot.stamp);
+	  slot.seq.store(pos + mask_ + 1, std::memory_order_release);
+	}
+	dequeue_pos_.store(pos, std::memory_order_release);
+	executed_.fetch_add(n, std::memory_order_relaxed);
+	return n;
+      }
 
-    public:
-      virtual void on(tool * t){ std::cout << " state on\n"; }
-      virtual void off(tool *t){ std::cout << " state off\n"; }
-    };
+      void run()
+      {
+	unsigned int idle = 0;
+	for (;;){
+	  if (drain()){
+	    idle = 0;
+	    continue;
+	  }
+	  if (!running_.load(std::memory_order_acquire) && !depth())
+	    return;
+	  if (++idle < 64)
+	    std::this_thread::yield();
+	  else
+	    std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+      }
 
-    void tool::on() 
-    { std::cout << "on is the state"; current_->on(this); }
-    void tool::off() 
-    { std::cout << "off is the state"; current_->off(this); }
-    
-    class OFF : public state{  // changing state OFF->on
-      
-    public:
-      void on (tool * t);
+      const std::size_t mask_;
+      const std::size_t batch_;
+      const overflow policy_;
+      std::unique_ptr<cell[]> cells_;
+      alignas(64) std::atomic<std::size_t> enqueue_pos_;
+      alignas(64) std::atomic<std::size_t> dequeue_pos_;
+      std::atomic<std::uint64_t> executed_;
+      std::atomic<std::uint64_t> dropped_;
+      std::atomic<std::uint64_t> failed_;
+      std::atomic<bool> running_;
+      log_histogram latency_;
+      std::thread executor_;
     };
 
-    class ON : public state{  // changing state off->ON
-      
+    // A file mapped whole, read-write and shared, for the journal
+    // here and Memento's checkpoints: opened (or created empty) and
+    // mapped by the constructor, unmapped and closed by the 
+    // destructor, also when the owner's constructor throws. Errors
+    // of the system calls throw std::system_error.
+
+    class mapped_file{
+
     public:
-      void off(tool * t){
+      explicit mapped_file(const char * path) : map_(0), size_(0)
+      {
+	fd_ = ::open(path, O_RDWR | O_CREAT, 0644);
+	if (fd_ < 0)
+	  throw std::system_error(errno, std::generic_category(), path);
+	try{
+	  struct stat st;
+	  if (::fstat(fd_, &st) < 0)
+	    fail("fstat");
+	  if (st.st_size)
+	    map(st.st_size);
+	}
+	catch (...){
+	  ::close(fd_);
+	  throw;
+	}
+      }
 
-	std::cout << "\tgoing from ON to OFF" << std::endl;
-	t->set_current(new OFF());
-	delete this;     // here I assume i am the one who destroy
+      ~mapped_file()
+      {
+	if (map_)
+	  ::munmap(map_, size_);
+	::close(fd_);
       }
-    };
 
-    void OFF::on(tool * t){
+      mapped_file(const mapped_file &) = delete;
+      mapped_file & operator=(const mapped_file &) = delete;
 
-      std::cout << "\tgoing from OFF to ON" << std::endl;
-      t->set_current(new ON());
-      delete this;      // here I assume i am the one who destroy
-    }
+      // bytes mapped, the size of the file; 0 for a new one
+      std::size_t size() const { return size_; }
+      unsigned char * data() const { return map_; }
 
-  }; // end State
+      // grow or shrink the file, and map it again
+      void resize(std::size_t size)
+      {
+	if (::ftruncate(fd_, size) < 0)
+	  fail("ftruncate");
+	map(size);
+      }
 
+      // msync the pages covering [from, from + len)
+      void sync(std::size_t from, std::size_t len)
+      {
+	static const std::size_t page = ::sysconf(_SC_PAGESIZE);
+	std::size_t start = from / page * page;
+	if (::msync(map_ + start, from + len - start, MS_SYNC) < 0)
+	  fail("msync");
+      }
 
-  namespace Strategy{
-    
-    // Strategy lets the algorithm vary independently 
+    private:
+      [[noreturn]] static void fail(const char * what)
+      { throw std::system_error(errno, std::generic_category(), what); }
+
+      void map(std::size_t size)
+      {
+	if (map_)
+	  ::munmap(map_, size_);
+	size_ = 0;
+	void * m = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (m == MAP_FAILED){
+	  map_ = 0;
+	  fail("mmap");
+	}
+	map_ = static_cast<unsigned char *>(m);
+	size_ = size;
+      }
+
+      int fd_;
+      unsigned char * map_;
+      std::size_t size_;
+    };
+
+    // Durable, replayable stream of commands. Each command is 
+    // serialized as (receiver id, action id, argument) and appended
+    // to a memory-mapped file; ids are the registration order of 
+    // receivers and actions, so the same registration after a 
+    // restart replays the stream against the new objects.
+    // Appends are made durable in groups: one msync of the records
+    // then of the header holding the committed length, every group
+    // appends. Records past the committed length are ignored.
+    // A journal has a single writer.
+
+    template <typename Receiver = client>
+    class command_journal{
+
+    public:
+      typedef void(Receiver::*action)(int);
+
+      command_journal(const char * path, std::size_t group = 64, 
+		      std::size_t chunk = 1 << 20) :
+	group_(group), chunk_(chunk), pending_(0), file_(path)
+      {
+	if (file_.size() == 0){
+	  file_.resize(sizeof(header) + chunk_);
+	  std::memcpy(head()->magic, magic_, sizeof(magic_));
+	  head()->committed = 0;
+	  file_.sync(0, sizeof(header));
+	}
+	else{
+	  if (file_.size() < sizeof(header) ||
+	      std::memcmp(head()->magic, magic_, sizeof(magic_)))
+	    throw std::runtime_error(std::string(path) + ": not a journal");
+	  if (head()->committed > file_.size() - sizeof(header) ||
+	      head()->committed % sizeof(record))
+	    throw std::runtime_error(std::string(path) + ": corrupt journal");
+	}
+	end_ = head()->committed;
+      }
+
+      // commits what is pending; an error doing so is lost, call
+      // commit() first to see it
+      ~command_journal()
+      {
+	try{
+	  commit();
+	}
+	catch (const std::system_error &){
+	}
+      }
+
+      command_journal(const command_journal &) = delete;
+      command_journal & operator=(const command_journal &) = delete;
+
+      // register in the same order before appending and replaying
+      std::uint32_t add_receiver(Receiver * r)
+      { receivers_.push_back(r); return receivers_.size() - 1; }
+      std::uint32_t add_action(action a)
+      { actions_.push_back(a); return actions_.size() - 1; }
+
+      void append(std::uint32_t receiver, std::uint32_t act, int what)
+      {
+	if (sizeof(header) + end_ + sizeof(record) > file_.size())
+	  file_.resize(file_.size() + chunk_);
+	record * r = reinterpret_cast<record *>(data() + end_);
+	r->receiver = receiver;
+	r->act = act;
+	r->what = what;
+	end_ += sizeof(record);
+	if (++pending_ >= group_)
+	  commit();
+      }
+
+      void append(Receiver * r, action a, int what)
+      { append(id_of(receivers_, r), id_of(actions_, a), what); }
+
+      // make all the appended records durable
+      void commit()
+      {
+	if (head()->committed == end_)
+	  return;
+	file_.sync(sizeof(header) + head()->committed, end_ - head()->committed);
+	head()->committed = end_;
+	file_.sync(0, sizeof(header));
+	pending_ = 0;
+      }
+
+      // execute the committed records in order, returns how many;
+      // throws before executing any if one names a receiver or an
+      // action that is not registered
+      std::size_t replay() const
+      {
+	const record * r = reinterpret_cast<const record *>(data());
+	const record * last = r + records();
+	for (const record * c = r; c != last; ++c)
+	  if (c->receiver >= receivers_.size() || c->act >= actions_.size())
+	    throw std::out_of_range("command_journal: record " + 
+				    std::to_string(c - r) + 
+				    " is not registered");
+	for (; r != last; ++r)
+	  (receivers_[r->receiver]->*actions_[r->act])(r->what);
+	return last - reinterpret_cast<const record *>(data());
+      }
+
+      std::size_t records() const 
+      { return head()->committed / sizeof(record); }
+      std::size_t bytes() const { return sizeof(header) + end_; }
+
+    private:
+      struct header{
+	char magic[8];
+	std::uint64_t committed;  // bytes of records made durable
+	char pad[48];
+      };
+
+      struct record{
+	std::uint32_t receiver;
+	std::uint32_t act;
+	std::int32_t what;
+      };
+
+      static constexpr char magic_[8] = { 'c','m','d','j','r','n','l','1' };
+
+      header * head() const { return reinterpret_cast<header *>(file_.data()); }
+      unsigned char * data() const { return file_.data() + sizeof(header); }
+
+      template <typename T>
+      static std::uint32_t id_of(const std::vector<T> & v, T x)
+      {
+	typename std::vector<T>::const_iterator it = 
+	  std::find(v.begin(), v.end(), x);
+	if (it == v.end())
+	  throw std::invalid_argument("command_journal: not registered");
+	return it - v.begin();
+      }
+
+      const std::size_t group_;
+      const std::size_t chunk_;
+      std::size_t pending_;
+      mapped_file file_;
+      std::uint64_t end_;     // bytes of records appended
+      std::vector<Receiver *> receivers_;
+      std::vector<action> actions_;
+    };
+
+  }; // end command
+
+  
+  namespace Iterator{
+
+    // An aggregate object such as a list should give you 
+    // a way to access its elements without exposing its 
+    // internal structure. 
+
+    class stack
+    {
+    private:
+      std::vector<int> items_;  // grows with amortized reserve
+
+    public:
+      friend class iterator; // friend it to access iterator
+      friend bool operator == (const stack &, const stack &);
+      stack() {}
+      
+      void push(int in) { items_.push_back(in); }
+      int pop() { int v = items_.back(); items_.pop_back(); return v; }
+      bool isEmpty() const { return items_.empty(); }
+      std::size_t size() const { return items_.size(); }
+      void reserve(std::size_t n) { items_.reserve(n); }
+
+      // push all of in, growing at most once
+      void push_range(std::span<const int> in)
+      { items_.insert(items_.end(), in.begin(), in.end()); }
+
+      // drop up to n items from the top, returns how many
+      std::size_t pop_n(std::size_t n)
+      { 
+	n = std::min(n, items_.size());
+	items_.resize(items_.size() - n);
+	return n;
+      }
+
+      // contiguous iterators from the bottom to the top, so the
+      // stack is a standard range: the algorithms, their execution
+      // policies and std::ranges all apply to it
+      typedef std::vector<int>::iterator range_iterator;
+      typedef std::vector<int>::const_iterator const_range_iterator;
+
+      range_iterator begin() { return items_.begin(); }
+      range_iterator end() { return items_.end(); }
+      const_range_iterator begin() const { return items_.begin(); }
+      const_range_iterator end() const { return items_.end(); }
+      int * data() { return items_.data(); }
+      const int * data() const { return items_.data(); }
+    };
+
+    class iterator{
+
+    private:
+      const stack &stk_;  // access the structure
+      std::size_t index_;
+
+    public:
+      iterator(const stack &s) : stk_(s), index_(0)
+      {}      // initialize the iterator
+      
+      void operator++() 
+      { ++index_; }
+
+      int operator()()  // get the end of structure
+      { return index_ != stk_.items_.size() ;}
+
+      int operator *()
+      { return stk_.items_[index_]; }
+    }; 
+
+    // sizes first, then blocks of items compared without branches
+    // so that the inner loop vectorizes, stopping at the first 
+    // block that differs
+
+    inline bool operator == (const stack &s1, 
+			     const stack &s2)
+    {
+      if (s1.items_.size() != s2.items_.size())
+	return false;
+
+      const int * a = s1.items_.data(), * b = s2.items_.data();
+      const std::size_t n = s1.items_.size(), block = 256;
+
+      for (std::size_t i = 0; i < n; i += block){
+	const std::size_t end = std::min(n, i + block);
+	int diff = 0;
+	for (std::size_t j = i; j < end; ++j)
+	  diff |= a[j] ^ b[j];
+	if (diff)
+	  return false;
+      }
+      return true;
+    }
+
+    static_assert(std::ranges::contiguous_range<stack> && 
+		  std::ranges::sized_range<stack>);
+
+    // Lazy pipelines over a stack: pipe(s) | filter(p) | map(f) only 
+    // records the stages, a terminal such as | reduce(init, op) runs
+    // them. The stages are folded into one sink called for each item
+    // reached through the iterator, so the whole pipeline is fused
+    // in a single pass without intermediate stacks.
+    // In chunked mode the items are instead copied a block at a time
+    // into a small buffer and each stage runs over the whole block 
+    // (a branch-free compaction for filter, a plain loop for map and
+    // reduce), loops the compiler can vectorize.
+
+    template <typename P>
+    struct filter_stage{
+
+      P pred_;
+
+      template <typename Sink>
+      auto wrap(Sink sink) const
+      { 
+	return [sink, pred = pred_](int v) mutable 
+	  { if (pred(v)) sink(v); };
+      }
+
+      std::size_t block(int * b, std::size_t n) const
+      {
+	std::size_t k = 0;
+	for (std::size_t j = 0; j < n; ++j){
+	  b[k] = b[j];
+	  k += pred_(b[j]) ? 1 : 0;
+	}
+	return k;
+      }
+    };
+
+    template <typename F>
+    struct map_stage{
+
+      F f_;
+
+      template <typename Sink>
+      auto wrap(Sink sink) const
+      { return [sink, f = f_](int v) mutable { sink(f(v)); }; }
+
+      std::size_t block(int * b, std::size_t n) const
+      {
+	for (std::size_t j = 0; j < n; ++j)
+	  b[j] = f_(b[j]);
+	return n;
+      }
+    };
+
+    template <typename P>
+    filter_stage<P> filter(P pred) { return filter_stage<P>{ pred }; }
+
+    template <typename F>
+    map_stage<F> map(F f) { return map_stage<F>{ f }; }
+
+    template <typename... Stages>
+    class pipeline{
+
+    public:
+      pipeline(const stack & s, std::tuple<Stages...> st, 
+	       std::size_t chunk = 0) : 
+	stk_(&s), stages_(st), chunk_(chunk) {};
+
+      // one more stage, still lazy
+      template <typename S>
+	requires requires (const S & st, int * b) { st.block(b, 0); }
+      pipeline<Stages..., S> operator | (S st) const
+      { 
+	return pipeline<Stages..., S>
+	  (*stk_, std::tuple_cat(stages_, std::make_tuple(st)), chunk_);
+      }
+
+      // the same pipeline, run block by block
+      pipeline chunked(std::size_t chunk = 1024) const
+      { return pipeline(*stk_, stages_, chunk); }
+
+      // feed every item through the stages: one at a time to sink,
+      // or in chunked mode a block at a time to block(buffer, n)
+      template <typename Sink, typename Block>
+      void run(Sink sink, Block block) const
+      {
+	if (!chunk_){
+	  auto fused = build<sizeof...(Stages)>(sink);
+	  for (iterator it(*stk_); it(); ++it)
+	    fused(*it);
+	  return;
+	}
+
+	std::vector<int> buffer(chunk_);
+	const int * items = stk_->data();
+	for (std::size_t i = 0; i < stk_->size(); i += chunk_){
+	  std::size_t n = std::min(chunk_, stk_->size() - i);
+	  std::copy(items + i, items + i + n, buffer.data());
+	  std::apply([&](const Stages &... st)
+		     { ((n = st.block(buffer.data(), n)), ...); }, stages_);
+	  block(static_cast<const int *>(buffer.data()), n);
+	}
+      }
+
+    private:
+      template <std::size_t I, typename Sink>
+      auto build(Sink sink) const
+      {
+	if constexpr (I == 0)
+	  return sink;
+	else
+	  return build<I - 1>(std::get<I - 1>(stages_).wrap(sink));
+      }
+
+      const stack * stk_;
+      std::tuple<Stages...> stages_;
+      std::size_t chunk_;
+    };
+
+    inline pipeline<> pipe(const stack & s) 
+    { return pipeline<>(s, std::tuple<>()); }
+
+    // terminals
+
+    template <typename T, typename Op>
+    struct reduce_stage{ T init_; Op op_; };
+
+    template <typename T, typename Op>
+    reduce_stage<T, Op> reduce(T init, Op op) 
+    { return reduce_stage<T, Op>{ init, op }; }
+
+    template <typename T>
+    reduce_stage<T, std::plus<T> > reduce(T init) 
+    { return reduce_stage<T, std::plus<T> >{ init, std::plus<T>() }; }
+
+    template <typename F>
+    struct for_each_stage{ F f_; };
+
+    template <typename F>
+    for_each_stage<F> for_each(F f) { return for_each_stage<F>{ f }; }
+
+    // f(const int * items, std::size_t n) on each block of the 
+    // chunked mode, for a kernel of its own over contiguous items;
+    // unchunked, each item is a block of one
+    template <typename F>
+    struct for_each_block_stage{ F f_; };
+
+    template <typename F>
+    for_each_block_stage<F> for_each_block(F f) 
+    { return for_each_block_stage<F>{ f }; }
+
+    template <typename... Stages, typename T, typename Op>
+    T operator | (const pipeline<Stages...> & p, reduce_stage<T, Op> r)
+    {
+      T acc = r.init_;
+      p.run([&acc, &r](int v) { acc = r.op_(acc, v); },
+	    [&acc, &r](const int * b, std::size_t n)
+	    { for (std::size_t j = 0; j < n; ++j) acc = r.op_(acc, b[j]); });
+      return acc;
+    }
+
+    template <typename... Stages, typename F>
+    void operator | (const pipeline<Stages...> & p, for_each_stage<F> f)
+    {
+      p.run([&f](int v) { f.f_(v); },
+	    [&f](const int * b, std::size_t n)
+	    { for (std::size_t j = 0; j < n; ++j) f.f_(b[j]); });
+    }
+
+    template <typename... Stages, typename F>
+    void operator | (const pipeline<Stages...> & p, for_each_block_stage<F> f)
+    {
+      p.run([&f](int v) { f.f_(static_cast<const int *>(&v), 1); },
+	    [&f](const int * b, std::size_t n) { f.f_(b, n); });
+    }
+  }; // end Iterator
+
+
+  namespace Mediator{
+
+    // Define an object that encapsulates how a set of objects interact. 
+    // promotes loose coupling
+
+    // Quite general design pattern
+    // for example a list is mediating between node objects
+
+    class node {
+
+    private:
+      int v_;
+
+    public:
+      node (int v) : v_(v){};
+      int getValue() const { return v_; }
+    };
+
+    class list { // mediating nodes
+
+    private:
+      std::vector<node *> values_;
+      typedef std::vector<node *>::const_iterator const_it;
+  
+    public:
+      void add(node *n){ values_.push_back(n);}
+      void traverse() 
+      { const_it it1 = values_.begin();
+	const_it it2 = values_.end();
+	Logging::line l;
+	for (; it1 != it2; it1++)
+	  l << " " << (*it1)->getValue();
+	l << '\n';
+      }
+    };
+
+    // A list owning its nodes in one contiguous array: add() hands 
+    // out the index of the node, which stays valid as the list 
+    // grows. traverse() formats the values into a reusable buffer 
+    // and writes it to the stream (or the log) once per chunk bytes.
+
+    class node_list{
+
+    public:
+      typedef std::size_t index;
+
+      node_list(std::size_t chunk = 1 << 16) : chunk_(chunk) {};
+
+      index add(int v) { nodes_.push_back(node(v)); return nodes_.size() - 1; }
+      node & operator[](index i) { return nodes_[i]; }
+      const node & operator[](index i) const { return nodes_[i]; }
+      std::size_t size() const { return nodes_.size(); }
+      void reserve(std::size_t n) { nodes_.reserve(n); }
+
+      void traverse(std::ostream & os)
+      {
+	format([&os](const char * s, std::size_t n) { os.write(s, n); });
+	os.flush();
+      }
+
+      void traverse()
+      {
+	format([](const char * s, std::size_t n) 
+	       { PATTERN_LOG_PART(std::string_view(s, n)); });
+      }
+
+    private:
+      template <typename Write>
+      void format(Write write)
+      {
+	const std::size_t width = 12;  // " " and an int
+	buffer_.resize(chunk_ + width + 1);
+	char * out = buffer_.data();
+	char * flush_at = out + chunk_;
+	char * p = out;
+
+	for (std::size_t i = 0; i < nodes_.size(); ++i){
+	  *p++ = ' ';
+	  p = std::to_chars(p, p + width, nodes_[i].getValue()).ptr;
+	  if (p >= flush_at){
+	    write(out, p - out);
+	    p = out;
+	  }
+	}
+	*p++ = '\n';
+	write(out, p - out);
+      }
+
+      std::vector<node> nodes_;
+      std::vector<char> buffer_;
+      std::size_t chunk_;
+    };
+
+    // A message bus between colleagues identified by their index.
+    // Every (sender, receiver) pair has its own single-producer 
+    // single-consumer ring, so each colleague can run on its own 
+    // thread without locks. send() lets the sender fill the message
+    // in place in the ring and receive() hands the receiver a 
+    // reference to it in place: messages are never copied.
+    // broadcast() fills one reference-counted slot of the sender's 
+    // pool and pushes only its index to every other colleague; the
+    // slot is reused once the last receiver is done with it.
+    // A message finding its ring (or the pool) full is dropped.
+
+    template <typename Message>
+    class message_bus{
+
+    public:
+      typedef std::size_t colleague;
+
+      struct channel_stats{
+	std::size_t depth;
+	std::uint64_t sent;
+	std::uint64_t dropped;
+      };
+
+      message_bus(std::size_t colleagues, std::size_t capacity = 1024,
+		  std::size_t shared_slots = 256) :
+	n_(colleagues), mask_(std::bit_ceil(capacity) - 1), 
+	slots_(shared_slots), channels_(new channel[n_ * n_]),
+	pools_(new shared_slot[n_ * slots_]), cursor_(n_, 0),
+	reachable_(new bool[n_ * n_])
+      {
+	for (std::size_t i = 0; i < n_ * n_; ++i)
+	  channels_[i].ring.reset(new entry[mask_ + 1]);
+      }
+
+      message_bus(const message_bus &) = delete;
+      message_bus & operator=(const message_bus &) = delete;
+
+      // fill(Message &) writes the message in place
+      template <typename F>
+      bool send(colleague from, colleague to, F fill)
+      {
+	channel & c = at(from, to);
+	entry * e = claim(c);
+	if (!e)
+	  return false;
+	e->shared = none_;
+	fill(e->msg);
+	publish(c);
+	return true;
+      }
+
+      // fill once, deliver to every other colleague with room;
+      // returns how many are reached
+      template <typename F>
+      std::size_t broadcast(colleague from, F fill)
+      {
+	shared_slot * slot = 0;
+	std::uint32_t id = 0;
+	for (std::size_t i = 0; i < slots_ && !slot; ++i){
+	  id = (cursor_[from] + i) % slots_;
+	  if (pools_[from * slots_ + id].refs.load
+	      (std::memory_order_acquire) == 0)
+	    slot = &pools_[from * slots_ + id];
+	}
+
+	// the rings with room now are the ones counted and published 
+	// to, even if another gets room meanwhile; only the sender 
+	// fills them up, so those keep theirs
+	bool * reach = &reachable_[from * n_];
+	std::uint32_t reached = 0;
+	for (colleague to = 0; to < n_; ++to){
+	  reach[to] = to != from && slot && has_room(at(from, to));
+	  if (reach[to])
+	    ++reached;
+	  else if (to != from)
+	    at(from, to).dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (!reached)
+	  return 0;
+
+	cursor_[from] = (id + 1) % slots_;
+	fill(slot->msg);
+	slot->refs.store(reached, std::memory_order_relaxed);
+	for (colleague to = 0; to < n_; ++to)
+	  if (reach[to]){
+	    channel & c = at(from, to);
+	    c.ring[c.head.load(std::memory_order_relaxed) & mask_].shared = id;
+	    publish(c);
+	  }
+	return reached;
+      }
+
+      // visit(colleague from, const Message &) for every message 
+      // pending for to; returns how many were visited
+      template <typename F>
+      std::size_t receive(colleague to, F visit)
+      {
+	std::size_t n = 0;
+	for (colleague from = 0; from < n_; ++from){
+	  channel & c = at(from, to);
+	  std::size_t tail = c.tail.load(std::memory_order_relaxed);
+	  std::size_t head = c.head.load(std::memory_order_acquire);
+	  for (; tail != head; ++tail, ++n){
+	    entry & e = c.ring[tail & mask_];
+	    if (e.shared == none_)
+	      visit(from, static_cast<const Message &>(e.msg));
+	    else{
+	      shared_slot & s = pools_[from * slots_ + e.shared];
+	      visit(from, static_cast<const Message &>(s.msg));
+	      s.refs.fetch_sub(1, std::memory_order_acq_rel);
+	    }
+	  }
+	  c.tail.store(tail, std::memory_order_release);
+	}
+	return n;
+      }
+
+      channel_stats stats(colleague from, colleague to) const
+      {
+	const channel & c = at(from, to);
+	channel_stats s;
+	s.depth = c.head.load(std::memory_order_relaxed) - 
+	  c.tail.load(std::memory_order_relaxed);
+	s.sent = c.sent.load(std::memory_order_relaxed);
+	s.dropped = c.dropped.load(std::memory_order_relaxed);
+	return s;
+      }
+
+    private:
+      static const std::uint32_t none_ = ~0u;
+
+      struct entry{
+	std::uint32_t shared;  // slot in the sender's pool, or none_
+	Message msg;
+      };
+
+      struct channel{
+	std::unique_ptr<entry[]> ring;
+	alignas(64) std::atomic<std::size_t> head{0};  // sender side
+	std::atomic<std::uint64_t> sent{0};
+	std::atomic<std::uint64_t> dropped{0};
+	alignas(64) std::atomic<std::size_t> tail{0};  // receiver side
+      };
+
+      struct shared_slot{
+	std::atomic<std::uint32_t> refs{0};
+	Message msg;
+      };
+
+      channel & at(colleague from, colleague to) 
+      { return channels_[from * n_ + to]; }
+      const channel & at(colleague from, colleague to) const
+      { return channels_[from * n_ + to]; }
+
+      bool has_room(const channel & c) const
+      { 
+	return c.head.load(std::memory_order_relaxed) - 
+	  c.tail.load(std::memory_order_acquire) <= mask_;
+      }
+
+      entry * claim(channel & c)
+      {
+	if (!has_room(c)){
+	  c.dropped.fetch_add(1, std::memory_order_relaxed);
+	  return 0;
+	}
+	return &c.ring[c.head.load(std::memory_order_relaxed) & mask_];
+      }
+
+      void publish(channel & c)
+      {
+	c.head.store(c.head.load(std::memory_order_relaxed) + 1, 
+		     std::memory_order_release);
+	c.sent.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      const std::size_t n_;
+      const std::size_t mask_;
+      const std::size_t slots_;
+      std::unique_ptr<channel[]> channels_;
+      std::unique_ptr<shared_slot[]> pools_;
+      std::vector<std::size_t> cursor_;  // next slot to try, per sender
+      std::unique_ptr<bool[]> reachable_;  // by broadcast(), per sender
+    };
+
+  }; // end mediator
+
+  namespace Memento{
+
+    // The client requests a Memento from the source object 
+    // when it needs to checkpoint the source object's state
+    // If the client subsequently needs to "rollback" the 
+    // source object's state, it hands the Memento back to 
+    // the source object for reinstatement.
+
+    class memento{ // memento
+
+    public:
+      memento(int val) : value_(val) {};
+      
+    private:
+      friend class client;
+      int value_;
+    };
+    
+    class client{ // client
+      
+    public:
+      client(int value) : value_(value) {};
+      void increment() { ++value_; } // change of state;
+      int get_value() { return value_; }
+
+      memento * create_memento() { return new memento(value_) ; }
+      void restore_from_memento(memento * m) { value_ = m->value_; }
+      
+    private:
+      int value_;
+
+    };
+
+    // A bounded undo history for states of any trivially copyable 
+    // type. Every keyframe_every snapshots one is kept in full, the 
+    // others only as the runs of granule bytes that changed since 
+    // the previous snapshot. Snapshots are appended to a ring arena 
+    // of budget bytes; when it is full the oldest keyframe is 
+    // evicted together with its deltas. restore() copies the 
+    // nearest keyframe and replays the deltas up to the snapshot.
+
+    template <typename State>
+    class memento_history{
+
+      static_assert(std::is_trivially_copyable_v<State>,
+		    "snapshots are taken byte by byte");
+
+    public:
+      typedef std::uint64_t id;
+
+      memento_history(std::size_t budget, std::size_t keyframe_every = 32,
+		      std::size_t granule = 64) :
+	arena_(budget), every_(keyframe_every), granule_(granule), 
+	first_(0), since_key_(0), last_(sizeof(State))
+      {
+	if (budget < sizeof(State))
+	  throw std::length_error("memento_history: budget below a keyframe");
+      }
+
+      // take a snapshot of s, returns its id
+      id save(const State & s)
+      {
+	const unsigned char * now = reinterpret_cast<const unsigned char *>(&s);
+	bool key = entries_.empty() || since_key_ + 1 >= every_;
+	std::size_t size = key ? sizeof(State) : delta_size(now);
+
+	if (!key && size >= sizeof(State)){  // no gain, keep it in full
+	  key = true;
+	  size = sizeof(State);
+	}
+	unsigned char * out = make_room(size);
+	if (!key && entries_.empty()){    // evicted its own keyframe
+	  key = true;
+	  size = sizeof(State);
+	  out = make_room(size);
+	}
+
+	if (key){
+	  std::memcpy(out, now, size);
+	  since_key_ = 0;
+	}
+	else{
+	  write_delta(now, out);
+	  ++since_key_;
+	}
+	entries_.push_back(entry{ std::size_t(out - arena_.data()), size, key });
+	std::memcpy(last_.data(), now, sizeof(State));
+	return newest();
+      }
+
+      // false when the snapshot was evicted or never taken
+      bool restore(id which, State & s) const
+      {
+	if (which < first_ || which >= first_ + entries_.size())
+	  return false;
+
+	std::size_t i = which - first_, k = i;
+	while (!entries_[k].keyframe)
+	  --k;
+	unsigned char * to = reinterpret_cast<unsigned char *>(&s);
+	std::memcpy(to, arena_.data() + entries_[k].offset, sizeof(State));
+	for (++k; k <= i; ++k)
+	  apply_delta(entries_[k], to);
+	return true;
+      }
+
+      id oldest() const { return first_; }
+      id newest() const { return first_ + entries_.size() - 1; }
+      std::size_t size() const { return entries_.size(); }
+
+      // arena bytes held by the retained snapshots
+      std::size_t bytes() const
+      {
+	std::size_t n = 0;
+	for (const entry & e : entries_)
+	  n += e.size;
+	return n;
+      }
+
+    private:
+      struct entry{
+	std::size_t offset;
+	std::size_t size;
+	bool keyframe;
+      };
+
+      struct run{           // followed by length changed bytes
+	std::uint32_t offset;
+	std::uint32_t length;
+      };
+
+      // call f(offset, length) for each run of changed granules
+      template <typename F>
+      void changed_runs(const unsigned char * now, F f) const
+      {
+	const std::size_t n = sizeof(State);
+	std::size_t start = n;
+	for (std::size_t g = 0; g < n; g += granule_){
+	  std::size_t len = std::min(granule_, n - g);
+	  bool changed = std::memcmp(now + g, last_.data() + g, len) != 0;
+	  if (changed && start == n)
+	    start = g;
+	  else if (!changed && start != n){
+	    f(start, g - start);
+	    start = n;
+	  }
+	}
+	if (start != n)
+	  f(start, n - start);
+      }
+
+      std::size_t delta_size(const unsigned char * now) const
+      {
+	std::size_t size = 0;
+	changed_runs(now, [&size](std::size_t, std::size_t len)
+		     { size += sizeof(run) + len; });
+	return size;
+      }
+
+      void write_delta(const unsigned char * now, unsigned char * out) const
+      {
+	changed_runs(now, [&out, now](std::size_t off, std::size_t len){
+	    run r = { std::uint32_t(off), std::uint32_t(len) };
+	    std::memcpy(out, &r, sizeof(run));
+	    std::memcpy(out + sizeof(run), now + off, len);
+	    out += sizeof(run) + len;
+	  });
+      }
+
+      void apply_delta(const entry & e, unsigned char * to) const
+      {
+	const unsigned char * p = arena_.data() + e.offset;
+	const unsigned char * end = p + e.size;
+	while (p != end){
+	  run r;
+	  std::memcpy(&r, p, sizeof(run));
+	  std::memcpy(to + r.offset, p + sizeof(run), r.length);
+	  p += sizeof(run) + r.length;
+	}
+      }
+
+      // the oldest keyframe goes, with the deltas built on it
+      void evict()
+      {
+	do{
+	  entries_.pop_front();
+	  ++first_;
+	} while (!entries_.empty() && !entries_.front().keyframe);
+      }
+
+      // contiguous room for size bytes, after the newest snapshot or
+      // wrapping to the start of the arena
+      unsigned char * make_room(std::size_t size)
+      {
+	for (;;){
+	  if (entries_.empty())
+	    return arena_.data();
+	  std::size_t head = entries_.front().offset;
+	  std::size_t end = entries_.back().offset + entries_.back().size;
+	  if (end > head){
+	    if (arena_.size() - end >= size)
+	      return arena_.data() + end;
+	    if (head >= size)
+	      return arena_.data();
+	  }
+	  else if (head - end >= size)
+	    return arena_.data() + end;
+	  evict();
+	}
+      }
+
+      std::vector<unsigned char> arena_;
+      const std::size_t every_;
+      const std::size_t granule_;
+      std::deque<entry> entries_;      // entries_[i] is snapshot first_ + i
+      id first_;
+      std::size_t since_key_;
+      std::vector<unsigned char> last_;  // newest snapshot, to diff against
+    };
+
+    // Checkpoints of a trivially copyable state in a memory-mapped 
+    // file. The file holds a header page and two page-aligned slots:
+    // a checkpoint goes to the slot not in use, copying and syncing
+    // only the pages that differ from it, then the header switches
+    // to that slot. A crash while checkpointing leaves the previous
+    // slot intact. After a restart view() points the state straight
+    // into the mapping, no deserialize pass.
+
+    template <typename State>
+    class memento_checkpoint{
+
+      static_assert(std::is_trivially_copyable_v<State>,
+		    "the state is mapped byte by byte");
+
+    public:
+      memento_checkpoint(const char * path) : 
+	page_(::sysconf(_SC_PAGESIZE)),
+	slot_size_((sizeof(State) + page_ - 1) / page_ * page_),
+	size_(page_ + 2 * slot_size_), file_(path)
+      {
+	if (file_.size() == 0){
+	  file_.resize(size_);
+	  std::memcpy(head()->magic, magic_, sizeof(magic_));
+	  head()->state_size = sizeof(State);
+	  file_.sync(0, page_);
+	}
+	else if (file_.size() != size_ ||
+		 std::memcmp(head()->magic, magic_, sizeof(magic_)) ||
+		 head()->state_size != sizeof(State) ||
+		 head()->current > 1)
+	  throw std::runtime_error(std::string(path) + ": not a checkpoint");
+      }
+
+      memento_checkpoint(const memento_checkpoint &) = delete;
+      memento_checkpoint & operator=(const memento_checkpoint &) = delete;
+
+      // make s durable, returns how many pages were written
+      std::size_t checkpoint(const State & s)
+      {
+	const unsigned char * from = reinterpret_cast<const unsigned char *>(&s);
+	std::uint32_t next = head()->generation ? 1 - head()->current : 0;
+	unsigned char * to = slot(next);
+	std::size_t written = 0;
+
+	for (std::size_t p = 0; p < sizeof(State); p += page_){
+	  std::size_t len = std::min(page_, sizeof(State) - p);
+	  if (!std::memcmp(to + p, from + p, len))
+	    continue;
+	  std::memcpy(to + p, from + p, len);
+	  ++written;
+	}
+	if (written)     // only the dirty pages go to disk
+	  file_.sync(to - file_.data(), sizeof(State));
+
+	head()->current = next;
+	++head()->generation;
+	file_.sync(0, page_);
+	return written;
+      }
+
+      // the last checkpoint in place in the mapping, 0 if none
+      const State * view() const
+      { 
+	if (!head()->generation)
+	  return 0;
+	return reinterpret_cast<const State *>(slot(head()->current));
+      }
+
+      bool restore(State & s) const
+      {
+	const State * v = view();
+	if (v)
+	  std::memcpy(static_cast<void *>(&s), v, sizeof(State));
+	return v != 0;
+      }
+
+      std::uint64_t generation() const { return head()->generation; }
+
+    private:
+      struct header{
+	char magic[8];
+	std::uint64_t state_size;
+	std::uint64_t generation;  // checkpoints taken, 0 for none
+	std::uint32_t current;     // slot of the last one
+      };
+
+      static constexpr char magic_[8] = { 'm','e','m','c','k','p','t','1' };
+
+      header * head() const { return reinterpret_cast<header *>(file_.data()); }
+      unsigned char * slot(std::uint32_t i) const 
+      { return file_.data() + page_ + i * slot_size_; }
+
+      const std::size_t page_;
+      const std::size_t slot_size_;
+      const std::size_t size_;
+      Command::mapped_file file_;
+    };
+
+  }; // end memento
+
+  namespace Observer{
+
+    // when one object changes state, 
+    // all its dependents are notified and updated automatically.
+    
+    class observer{
+
+    public:
+      virtual void update(int value) = 0;
+    };
+
+    class a_observer : public observer{
+
+    public:
+      void update(int value) 
+      { PATTERN_LOG("\ta seeing " << value); }
+    };
+
+    class b_observer : public observer{
+
+    public:
+      void update(int value) 
+      { PATTERN_LOG("\tb seeing " << value); }
+    };
+
+    // Asynchronous delivery to an observer: update() only queues the
+    // value, and a thread of its own calls the target. The queue is 
+    // bounded; when the target falls behind the newest value replaces
+    // the last queued one (latest value wins) and the one replaced 
+    // counts as merged, so the publisher never waits on it.
+    // stop() ends the deliveries for good; destroying the wrapper 
+    // delivers what is queued first.
+
+    class async_observer : public observer{
+
+    public:
+      async_observer(observer * target, std::size_t capacity = 64) :
+	target_(target), capacity_(capacity), published_(0), seen_(0),
+	delivered_(0), merged_(0), busy_(false), stop_(false), 
+	stopping_(false), worker_([this] { run(); }) {};
+
+      ~async_observer()
+      {
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  stopping_ = true;
+	}
+	ready_.notify_one();
+	if (worker_.joinable())
+	  worker_.join();
+      }
+
+      // drop what is queued and deliver nothing more; returns once a
+      // delivery under way is done, unless called from inside it
+      void stop()
+      {
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  stop_ = stopping_ = true;
+	  queue_.clear();
+	}
+	ready_.notify_one();
+	idle_.notify_all();
+	if (worker_.joinable() && !own_thread())
+	  worker_.join();
+      }
+
+      // the caller is the thread delivering to the target
+      bool own_thread() const 
+      { return worker_.get_id() == std::this_thread::get_id(); }
+
+      void update(int value)
+      {
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  if (stop_)
+	    return;
+	  ++published_;
+	  if (queue_.size() < capacity_)
+	    queue_.push_back(pending{ value, published_ });
+	  else{
+	    queue_.back() = pending{ value, published_ };
+	    ++merged_;
+	  }
+	}
+	ready_.notify_one();
+      }
+
+      // wait until every queued value has been delivered
+      void flush()
+      {
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_.wait(lock, [this] { return queue_.empty() && !busy_; });
+      }
+
+      observer * target() const { return target_; }
+
+      // updates published since the last one the target has seen
+      std::uint64_t lag() const
+      { std::lock_guard<std::mutex> lock(mutex_); return published_ - seen_; }
+      std::uint64_t delivered() const
+      { std::lock_guard<std::mutex> lock(mutex_); return delivered_; }
+      std::uint64_t merged() const
+      { std::lock_guard<std::mutex> lock(mutex_); return merged_; }
+
+    private:
+      struct pending{
+	int value;
+	std::uint64_t seq;
+      };
+
+      void run()
+      {
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;){
+	  ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+	  if (queue_.empty())      // stopping, all delivered
+	    return;
+	  pending p = queue_.front();
+	  queue_.pop_front();
+	  busy_ = true;
+
+	  lock.unlock();
+	  target_->update(p.value);
+	  lock.lock();
+
+	  busy_ = false;
+	  seen_ = p.seq;
+	  ++delivered_;
+	  if (queue_.empty())
+	    idle_.notify_all();
+	}
+      }
+
+      observer * target_;
+      const std::size_t capacity_;
+      std::deque<pending> queue_;
+      std::uint64_t published_;
+      std::uint64_t seen_;
+      std::uint64_t delivered_;
+      std::uint64_t merged_;
+      bool busy_;
+      bool stop_;        // nothing more is queued
+      bool stopping_;    // the worker ends once the queue is empty
+      mutable std::mutex mutex_;
+      std::condition_variable ready_;
+      std::condition_variable idle_;
+      std::thread worker_;
+    };
+
+    // Readers of a shared pointer announce themselves in a counter
+    // picked by the parity of the current epoch, spread over padded 
+    // slots per thread: entering and leaving are two atomic 
+    // increments, no lock. After swapping the pointer a writer flips
+    // the epoch twice, each time waiting for the readers of the 
+    // previous parity to leave; then no reader can still hold the 
+    // old value and it can be freed (read-copy-update).
+
+    class read_epochs{
+
+    public:
+      read_epochs() : epoch_(0) {};
+
+      unsigned int enter()
+      {
+	++depth_;
+	unsigned int parity = epoch_.load() & 1;
+	counts_[parity][slot()].readers.fetch_add(1);
+	return parity;
+      }
+
+      void leave(unsigned int parity)
+      {
+	counts_[parity][slot()].readers.fetch_sub(1, std::memory_order_release);
+	--depth_;
+      }
+
+      // wait out every reader that may hold a value replaced before 
+      void synchronize()
+      {
+	for (int flip = 0; flip < 2; ++flip){
+	  unsigned int old = epoch_.fetch_add(1) & 1;
+	  while (readers(old))
+	    std::this_thread::yield();
+	}
+      }
+
+      class guard{
+
+      public:
+	guard(read_epochs & e) : e_(e), parity_(e.enter()) {};
+	~guard() { e_.leave(parity_); }
+
+      private:
+	read_epochs & e_;
+	unsigned int parity_;
+      };
+
+      // true when this thread is between enter() and leave()
+      static bool reading() { return depth_ > 0; }
+
+    private:
+      static const std::size_t slots_ = 64;
+
+      struct alignas(64) counter{
+	std::atomic<long> readers{0};
+      };
+
+      static std::size_t slot()
+      {
+	static thread_local std::size_t s = 
+	  std::hash<std::thread::id>()(std::this_thread::get_id()) % slots_;
+	return s;
+      }
+
+      long readers(unsigned int parity) const
+      {
+	long n = 0;
+	for (std::size_t i = 0; i < slots_; ++i)
+	  n += counts_[parity][i].readers.load();
+	return n;
+      }
+
+      static inline thread_local int depth_ = 0;
+      std::atomic<unsigned int> epoch_;
+      counter counts_[2][slots_];
+    };
+
+    // The observers are an immutable list swapped on attach and 
+    // detach (copy on write): notify() walks the current list 
+    // without a lock while observers come and go from any thread,
+    // and a replaced list is freed once no notify() can hold it.
+    // A list replaced from inside an update() is freed later, by 
+    // the next attach or detach outside of one.  Detaching an
+    // asynchronous observer stops and joins its thread, so once 
+    // detach() returns the target can be destroyed; the wrapper 
+    // itself is freed after the grace period, or later as a list is
+    // when detached from inside an update() or from its own thread.
+    // Observers attached to a topic are kept in a list of their own
+    // and only called for changes on that topic, the others are 
+    // called for every change.
+
+    typedef std::uint32_t topic;
+
+    class subject{
+
+    private:
+      typedef std::vector<observer *> observer_vector;
+      typedef observer_vector::const_iterator const_it;
+
+      struct observer_list{
+	observer_vector all;                  // any change
+	std::unordered_map<topic, observer_vector> topics;
+
+	void remove(observer * o)
+	{
+	  all.erase(std::remove(all.begin(), all.end(), o), all.end());
+	  for (auto & t : topics)
+	    t.second.erase(std::remove(t.second.begin(), t.second.end(), o),
+			   t.second.end());
+	}
+      };
+
+      static void update_all(const observer_vector & v, int value)
+      {
+	const_it it = v.begin(), it_end = v.end();
+	for (; it != it_end; ++it)
+	  (*it)->update(value);
+      }
+
+      std::atomic<int> value_;
+      std::atomic<const observer_list *> observers_;
+      read_epochs readers_;
+      std::mutex writers_;
+      std::vector<const observer_list *> retired_;
+      std::vector<std::shared_ptr<async_observer> > async_;
+      std::vector<std::shared_ptr<async_observer> > retired_async_;
+
+      template <typename F>
+      void change_observers(F change)
+      {
+	std::vector<const observer_list *> replaced;
+	std::vector<std::shared_ptr<async_observer> > stopped;
+	{
+	  std::lock_guard<std::mutex> lock(writers_);
+	  observer_list * l = new observer_list(*observers_.load());
+	  change(*l);
+	  retired_.push_back(observers_.exchange(l));
+	  if (read_epochs::reading())
+	    return;
+	  replaced.swap(retired_);
+	  for (std::size_t i = 0; i < retired_async_.size(); ++i)
+	    if (!retired_async_[i]->own_thread())  // not joining itself
+	      stopped.push_back(std::move(retired_async_[i]));
+	  std::erase(retired_async_, nullptr);
+	}
+	// not holding writers_, so that an update() can attach
+	readers_.synchronize();
+	for (std::size_t i = 0; i < replaced.size(); ++i)
+	  delete replaced[i];
+	stopped.clear();
+      }
+
+    public:
+      subject() : value_(0), observers_(new observer_list()) {};
+      ~subject()
+      {
+	std::vector<std::shared_ptr<async_observer> > async, retired;
+	{
+	  std::lock_guard<std::mutex> lock(writers_);
+	  async.swap(async_);
+	  retired.swap(retired_async_);
+	}
+	async.clear();       // their threads deliver what is queued
+	retired.clear();
+	delete observers_.load();
+	for (std::size_t i = 0; i < retired_.size(); ++i)
+	  delete retired_[i];
+      }
+
+      subject(const subject &) = delete;
+      subject & operator=(const subject &) = delete;
+
+      void set_value(int value) { value_ = value; notify(value); }
+
+      // a change on topic t
+      void set_value(topic t, int value) { value_ = value; notify(t, value); }
+
+      // attach the observers
+      void attach(observer * o)
+      { change_observers([o](observer_list & l) { l.all.push_back(o); }); }
+
+      // o only sees the changes on topic t
+      void attach(observer * o, topic t)
+      { change_observers([o, t](observer_list & l) 
+			 { l.topics[t].push_back(o); }); }
+
+      // many at once: the list is copied and replaced a single time,
+      // where attaching one by one copies it for each
+      void attach(std::span<observer * const> os)
+      { change_observers([os](observer_list & l) 
+			 { l.all.insert(l.all.end(), os.begin(), os.end()); }); }
+
+      void attach(std::span<const std::pair<observer *, topic> > os)
+      { change_observers([os](observer_list & l){
+	    for (std::size_t i = 0; i < os.size(); ++i)
+	      l.topics[os[i].second].push_back(os[i].first); 
+	  }); }
+
+      // o, or its asynchronous wrapper, is no longer updated once
+      // this returns
+      void detach(observer * o)
+      {
+	std::vector<std::shared_ptr<async_observer> > gone;
+	change_observers([this, o, &gone](observer_list & l){
+	    for (std::size_t i = 0; i < async_.size(); ++i)
+	      if (async_[i]->target() == o){
+		l.remove(async_[i].get());
+		gone.push_back(std::move(async_[i]));
+	      }
+	    std::erase(async_, nullptr);
+	    l.remove(o);
+	  });
+	for (std::size_t i = 0; i < gone.size(); ++i)
+	  gone[i]->stop();
+	// past the grace period no notify() can reach them, unless
+	// still running around this call
+	const bool reading = read_epochs::reading();
+	std::lock_guard<std::mutex> lock(writers_);
+	for (std::size_t i = 0; i < gone.size(); ++i)
+	  if (reading || gone[i]->own_thread())
+	    retired_async_.push_back(std::move(gone[i]));
+      }
+
+      // o is updated on its own thread, through a bounded queue
+      async_observer & attach_async(observer * o, std::size_t capacity = 64)
+      { 
+	async_observer * a = new async_observer(o, capacity);
+	{
+	  std::lock_guard<std::mutex> lock(writers_);
+	  async_.emplace_back(a);
+	}
+	attach(a);
+	return *a;
+      }
+
+      // wait for the asynchronous observers to catch up
+      void flush()
+      {
+	std::vector<std::shared_ptr<async_observer> > all;
+	{
+	  std::lock_guard<std::mutex> lock(writers_);
+	  all = async_;       // kept alive, even if detached meanwhile
+	}
+	for (std::size_t i = 0; i < all.size(); ++i)
+	  all[i]->flush();
+      }
+
+      void notify() { notify(value_); }
+
+      void notify(int value)
+      { 
+	read_epochs::guard reading(readers_);
+	update_all(observers_.load()->all, value);
+      }
+
+      // only the observers of t and the ones of every change
+      void notify(topic t, int value)
+      { 
+	read_epochs::guard reading(readers_);
+	const observer_list * l = observers_.load();
+	update_all(l->all, value);
+	std::unordered_map<topic, observer_vector>::const_iterator 
+	  it = l->topics.find(t);
+	if (it != l->topics.end())
+	  update_all(it->second, value);
+      }
+    };
+  }; // end observer
+
+  namespace State {
+    
+    // Allow an object to alter its behavior when its 
+    // internal state changes. The object will appear 
+    // to change its class.
+
+    class tool{
+
+    private:
+      class state * current_;
+
+    public:
+      void set_current (state * s) { current_=s; };
+      void on();
+      void off();
+    };
+
+    class state{
+
+    public:
+      virtual void on(tool * t){ PATTERN_LOG(" state on"); }
+      virtual void off(tool *t){ PATTERN_LOG(" state off"); }
+    };
+
+    void tool::on() 
+    { PATTERN_LOG_PART("on is the state"); current_->on(this); }
+    void tool::off() 
+    { PATTERN_LOG_PART("off is the state"); current_->off(this); }
+    
+    class OFF : public state{  // changing state OFF->on
+      
+    public:
+      void on (tool * t);
+    };
+
+    class ON : public state{  // changing state off->ON
+      
+    public:
+      void off(tool * t){
+
+	PATTERN_LOG("\tgoing from ON to OFF");
+	t->set_current(new OFF());
+	delete this;     // here I assume i am the one who destroy
+      }
+    };
+
+    void OFF::on(tool * t){
+
+      PATTERN_LOG("\tgoing from OFF to ON");
+      t->set_current(new ON());
+      delete this;      // here I assume i am the one who destroy
+    }
+
+    // A state machine without state objects: states and events are
+    // enum entries (ending with count) and the transitions are 
+    // declared in a table built at compile time, event x state -> 
+    // next state + action on a context. fire() is one lookup in the
+    // table and an indirect call, no allocation. Events without a 
+    // transition leave the state unchanged.
+
+    template <typename S, typename E, typename Context>
+    struct transition{
+      E event;
+      S from;
+      S to;
+      void (*action)(Context &);
+    };
+
+    template <typename S, typename E, typename Context>
+    struct transition_table{
+
+      typedef S state_type;
+      typedef E event_type;
+      typedef Context context_type;
+
+      static const std::size_t states = std::size_t(S::count);
+      static const std::size_t events = std::size_t(E::count);
+
+      struct cell{
+	S to;
+	void (*action)(Context &);
+      };
+
+      template <std::size_t N>
+      constexpr transition_table(const transition<S, E, Context> (&ts)[N])
+	: cells()
+      {
+	for (std::size_t e = 0; e < events; ++e)
+	  for (std::size_t s = 0; s < states; ++s)
+	    cells[e][s] = cell{ S(s), 0 };
+	for (std::size_t i = 0; i < N; ++i)
+	  cells[std::size_t(ts[i].event)][std::size_t(ts[i].from)] = 
+	    cell{ ts[i].to, ts[i].action };
+      }
+
+      constexpr const cell & at(S s, E e) const
+      { return cells[std::size_t(e)][std::size_t(s)]; }
+
+      cell cells[events][states];
+    };
+
+    template <const auto & Table>
+    class state_machine{
+
+      typedef std::remove_cvref_t<decltype(Table)> table;
+
+    public:
+      typedef typename table::state_type state_type;
+      typedef typename table::event_type event_type;
+      typedef typename table::context_type context_type;
+
+      state_machine(context_type & c, state_type initial) : 
+	context_(c), current_(initial) {};
+
+      void fire(event_type e)
+      {
+	const typename table::cell & c = Table.at(current_, e);
+	if (c.action)
+	  c.action(context_);
+	current_ = c.to;
+      }
+
+      state_type current() const { return current_; }
+
+    private:
+      context_type & context_;
+      state_type current_;
+    };
+
+    // the tool above as a table: pressing on or off a switch
+
+    enum class power : std::uint8_t { OFF, ON, count };
+    enum class press : std::uint8_t { ON, OFF, count };
+
+    struct switch_counts{
+      unsigned long on = 0;
+      unsigned long off = 0;
+    };
+
+    inline constexpr transition<power, press, switch_counts> 
+    switch_transitions[] = {
+      { press::ON, power::OFF, power::ON, 
+	[](switch_counts & c) { ++c.on; } },
+      { press::OFF, power::ON, power::OFF, 
+	[](switch_counts & c) { ++c.off; } },
+    };
+
+    inline constexpr transition_table<power, press, switch_counts> 
+    switch_table(switch_transitions);
+
+    typedef state_machine<switch_table> switch_machine;
+
+    // Many instances of the same machine stored as one array of 
+    // small integer states (structure of arrays). fire() applies 
+    // one event per instance to all of them at once; for tables of 
+    // up to 16 cells the next states come from byte shuffles, 16 or 
+    // 32 instances per instruction, looking up (event << k) | state.
+    // The work can be split across threads. Actions are not run in
+    // this batched form, only the states move.
+
+    template <const auto & Table>
+    class state_machines{
+
+      typedef std::remove_cvref_t<decltype(Table)> table;
+
+    public:
+      typedef typename table::state_type state_type;
+      typedef typename table::event_type event_type;
+
+      static_assert(sizeof(state_type) == 1 && sizeof(event_type) == 1,
+		    "states and events are stored as bytes");
+
+      state_machines(std::size_t n, state_type initial) : 
+	states_(n, std::uint8_t(initial)) {};
+
+      std::size_t size() const { return states_.size(); }
+      state_type state(std::size_t i) const { return state_type(states_[i]); }
+
+      // fire events[i] on instance i
+      void fire(std::span<const event_type> events, unsigned int threads = 1)
+      {
+	const std::uint8_t * ev = 
+	  reinterpret_cast<const std::uint8_t *>(events.data());
+	const std::size_t n = std::min(events.size(), states_.size());
+	if (threads <= 1 || n < 4096){
+	  fire_range(ev, 0, n);
+	  return;
+	}
+
+	const std::size_t chunk = (n / threads + 63) / 64 * 64;
+	std::vector<std::thread> workers;
+	for (std::size_t from = chunk; from < n; from += chunk)
+	  workers.emplace_back([this, ev, from, chunk, n] 
+			       { fire_range(ev, from, std::min(n, from + chunk)); });
+	fire_range(ev, 0, std::min(n, chunk));
+	for (std::size_t i = 0; i < workers.size(); ++i)
+	  workers[i].join();
+      }
+
+    private:
+      static constexpr unsigned int shift_ = std::bit_width(table::states - 1);
+      static constexpr std::size_t cells_ = table::events << shift_;
+
+      struct lookup{
+	alignas(16) std::uint8_t next[cells_ < 16 ? 16 : cells_];
+      };
+
+      static constexpr lookup build()
+      {
+	lookup l{};
+	for (std::size_t e = 0; e < table::events; ++e)
+	  for (std::size_t s = 0; s < table::states; ++s)
+	    l.next[(e << shift_) | s] = 
+	      std::uint8_t(Table.at(state_type(s), event_type(e)).to);
+	return l;
+      }
+
+      static constexpr lookup lookup_ = build();
+
+      void fire_range(const std::uint8_t * ev, std::size_t i, std::size_t end)
+      {
+	std::uint8_t * st = states_.data();
+
+#if defined(__SSSE3__)
+	if constexpr (cells_ <= 16){
+	  const std::uint8_t high = std::uint8_t(0xff << shift_);
+	  const __m128i lut = _mm_load_si128
+	    (reinterpret_cast<const __m128i *>(lookup_.next));
+#if defined(__AVX2__)
+	  const __m256i lut2 = _mm256_broadcastsi128_si256(lut);
+	  const __m256i mask2 = _mm256_set1_epi8(high);
+	  for (; i + 32 <= end; i += 32){
+	    __m256i s = _mm256_loadu_si256(reinterpret_cast<__m256i *>(st + i));
+	    __m256i e = _mm256_loadu_si256
+	      (reinterpret_cast<const __m256i *>(ev + i));
+	    __m256i at = _mm256_or_si256
+	      (_mm256_and_si256(_mm256_slli_epi16(e, shift_), mask2), s);
+	    _mm256_storeu_si256(reinterpret_cast<__m256i *>(st + i), 
+				_mm256_shuffle_epi8(lut2, at));
+	  }
+#endif
+	  const __m128i mask = _mm_set1_epi8(high);
+	  for (; i + 16 <= end; i += 16){
+	    __m128i s = _mm_loadu_si128(reinterpret_cast<__m128i *>(st + i));
+	    __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ev + i));
+	    __m128i at = _mm_or_si128
+	      (_mm_and_si128(_mm_slli_epi16(e, shift_), mask), s);
+	    _mm_storeu_si128(reinterpret_cast<__m128i *>(st + i), 
+			     _mm_shuffle_epi8(lut, at));
+	  }
+	}
+#endif
+	for (; i < end; ++i)
+	  st[i] = lookup_.next[(ev[i] << shift_) | st[i]];
+      }
+
+      std::vector<std::uint8_t> states_;
+    };
+
+    typedef state_machines<switch_table> switch_machines;
+
+  }; // end State
+
+
+  namespace Strategy{
+    
+    // Strategy lets the algorithm vary independently 
     // from the clients that use it.
 
-    enum ALGO { ALGO1, ALGO2 };
+    enum ALGO { ALGO1, ALGO2 };
+
+    class strategy{
+
+    public:
+      virtual void do_it() = 0;
+    };
+
+    class algo1 : public strategy{
+
+      void do_it() { PATTERN_LOG("\tcalling algo1");}
+    };
+
+    class algo2 : public strategy{
+
+      void do_it() { PATTERN_LOG("\tcalling algo2");}
+    };
+
+    
+    class testbed{
+
+    public: 
+
+      testbed() : strategy_(NULL) {};
+      void choose_strategy (unsigned int what)
+      {
+	switch (what){   // the strategies are made once and kept
+	case ALGO2 : 
+	  strategy_ = &algo2_;
+	  break;
+	case ALGO1 : 
+	default:
+	  strategy_ = &algo1_;
+	  break;
+	}
+      strategy_->do_it();
+      }
+    private:      
+      strategy * strategy_;
+      algo1 algo1_;
+      algo2 algo2_;
+    };   
+
+    // Picks among candidate strategies by measuring them on the live
+    // inputs. Calls are bucketed by the size class of their input 
+    // (its bit width); in each bucket every candidate is first run 
+    // warmup times, then calls go to the fastest one, while every
+    // explore_every-th call still runs another candidate in turn, so
+    // that a change in the winner is noticed. Times are exponential
+    // moving averages, refreshed on explored calls and on one in 
+    // sample_every of the others. The candidates are kept for the 
+    // lifetime of the selector; running one with none added throws
+    // std::logic_error, a zero explore_every or sample_every throws
+    // std::invalid_argument.
+
+    template <typename Input>
+    class adaptive_strategy{
+
+    public:
+      typedef std::function<void(Input &)> candidate;
+
+      struct decision{
+	std::size_t bucket;          // inputs of size below 2^bucket
+	std::vector<std::uint64_t> calls;  // per candidate
+	std::vector<double> mean_ns;
+	std::size_t best;
+      };
+
+      adaptive_strategy(std::size_t warmup = 8, std::size_t explore_every = 64,
+			std::size_t sample_every = 16) : 
+	warmup_(warmup), explore_every_(explore_every), 
+	sample_every_(sample_every) {
+	if (explore_every_ == 0 || sample_every_ == 0)
+	  throw std::invalid_argument("adaptive_strategy: explore_every and "
+				      "sample_every must be positive");
+      };
+
+      std::size_t add(const std::string & name, candidate c)
+      {
+	names_.push_back(name);
+	candidates_.push_back(c);
+	buckets_.clear();
+	return candidates_.size() - 1;
+      }
+
+      // run the chosen candidate on in, of the given size
+      void run(Input & in, std::size_t size)
+      {
+	if (candidates_.empty())
+	  throw std::logic_error("adaptive_strategy: no candidate");
+	bucket & b = at(std::bit_width(size));
+	++b.calls;
+
+	std::size_t pick = b.best, fewest = 0;
+	for (std::size_t c = 1; c < candidates_.size(); ++c)
+	  if (b.stats[c].runs < b.stats[fewest].runs)
+	    fewest = c;
+
+	bool timed;
+	if (b.stats[fewest].runs < warmup_){
+	  pick = fewest;
+	  timed = true;
+	}
+	else if (candidates_.size() > 1 && b.calls % explore_every_ == 0){
+	  b.explore = (b.explore + 1) % candidates_.size();
+	  if (b.explore == b.best)
+	    b.explore = (b.explore + 1) % candidates_.size();
+	  pick = b.explore;
+	  timed = true;
+	}
+	else
+	  timed = b.calls % sample_every_ == 0;
+
+	++b.stats[pick].runs;
+	if (!timed){
+	  candidates_[pick](in);
+	  return;
+	}
+
+	std::chrono::steady_clock::time_point start = 
+	  std::chrono::steady_clock::now();
+	candidates_[pick](in);
+	double ns = std::chrono::duration<double, std::nano>
+	  (std::chrono::steady_clock::now() - start).count();
+
+	stat & s = b.stats[pick];
+	s.mean_ns = s.timed ? s.mean_ns + (ns - s.mean_ns) / 8 : ns;
+	++s.timed;
+	for (std::size_t c = 0; c < candidates_.size(); ++c)
+	  if (b.stats[c].timed && (!b.stats[b.best].timed || 
+				   b.stats[c].mean_ns < b.stats[b.best].mean_ns))
+	    b.best = c;
+      }
+
+      const std::string & name(std::size_t c) const { return names_[c]; }
+
+      // what was decided, for each size class seen so far
+      std::vector<decision> decisions() const
+      {
+	std::vector<decision> all;
+	for (std::size_t i = 0; i < buckets_.size(); ++i){
+	  if (!buckets_[i].calls)
+	    continue;
+	  decision d;
+	  d.bucket = i;
+	  d.best = buckets_[i].best;
+	  for (std::size_t c = 0; c < candidates_.size(); ++c){
+	    d.calls.push_back(buckets_[i].stats[c].runs);
+	    d.mean_ns.push_back(buckets_[i].stats[c].mean_ns);
+	  }
+	  all.push_back(d);
+	}
+	return all;
+      }
+
+    private:
+      struct stat{
+	std::uint64_t runs = 0;
+	std::uint64_t timed = 0;
+	double mean_ns = 0;
+      };
+
+      struct bucket{
+	std::uint64_t calls = 0;
+	std::size_t best = 0;
+	std::size_t explore = 0;
+	std::vector<stat> stats;
+      };
+
+      bucket & at(std::size_t i)
+      {
+	if (i >= buckets_.size())
+	  buckets_.resize(i + 1);
+	if (buckets_[i].stats.empty())
+	  buckets_[i].stats.resize(candidates_.size());
+	return buckets_[i];
+      }
+
+      const std::size_t warmup_;
+      const std::size_t explore_every_;
+      const std::size_t sample_every_;
+      std::vector<std::string> names_;
+      std::vector<candidate> candidates_;
+      std::vector<bucket> buckets_;
+    };
+  } // end Strategy
+
+  namespace Template{
+    
+    // Define the skeleton of an algorithm 
+    // deferring some steps to client subclasses
+     
+    class algorithm_base{
+
+      void a() { PATTERN_LOG("\tA"); }
+      void b() { PATTERN_LOG("\tB"); }
+      void c() { PATTERN_LOG("\tC"); }
+      virtual void X() = 0;
+      virtual void Y() = 0;
+
+    public:
+
+      void execute() { a(); X(); b();  Y(); c();}
+    };
+      
+    class algorithm_refinement_first_model : public algorithm_base{
+      
+      void X() { PATTERN_LOG("\tX1"); }
+      void Y() { PATTERN_LOG("\tY1"); }      
+    };
+
+    class algorithm_refinement_second_model :public algorithm_base{
+      
+      void X() { PATTERN_LOG("\tX2"); }
+      void Y() { PATTERN_LOG("\tY2"); }      
+    };
+
+    // The same skeleton bound at compile time (CRTP): the refinement
+    // passes itself to the base, so X() and Y() are plain calls that
+    // inline. Each of the five steps runs through a timing policy:
+    // no_timing just calls it, step_timing records its cycles in a
+    // lock-free histogram per step.
+
+    struct no_timing{
+
+      template <typename F>
+      void step(std::size_t, F f) { f(); }
+    };
+
+    class step_timing{
+
+    public:
+      static const std::size_t steps = 5;   // a, X, b, Y, c
+
+      template <typename F>
+      void step(std::size_t i, F f)
+      {
+	std::uint64_t start = cycles();
+	f();
+	histograms_[i].record(cycles() - start);
+      }
+
+      const Command::log_histogram & histogram(std::size_t i) const
+      { return histograms_[i]; }
+
+      static const char * name(std::size_t i)
+      { 
+	static const char * names[steps] = { "a", "X", "b", "Y", "c" };
+	return names[i];
+      }
+
+      static std::uint64_t cycles()
+      {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>
+	  (std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+      }
+
+    private:
+      Command::log_histogram histograms_[steps];
+    };
+
+    template <typename Derived, typename Timing = no_timing>
+    class static_algorithm{
+
+      void a() { PATTERN_LOG("\tA"); }
+      void b() { PATTERN_LOG("\tB"); }
+      void c() { PATTERN_LOG("\tC"); }
+
+      Derived & derived() { return static_cast<Derived &>(*this); }
+
+    public:
+
+      void execute() 
+      { 
+	timing_.step(0, [this] { a(); });
+	timing_.step(1, [this] { derived().X(); });
+	timing_.step(2, [this] { b(); });
+	timing_.step(3, [this] { derived().Y(); });
+	timing_.step(4, [this] { c(); });
+      }
+
+      const Timing & timing() const { return timing_; }
+
+    private:
+      [[no_unique_address]] Timing timing_;
+    };
+
+    template <typename Timing = no_timing>
+    class static_refinement_first_model : 
+      public static_algorithm<static_refinement_first_model<Timing>, Timing>{
+      
+      friend class static_algorithm<static_refinement_first_model, Timing>;
+      void X() { PATTERN_LOG("\tX1"); }
+      void Y() { PATTERN_LOG("\tY1"); }      
+    };
+
+    template <typename Timing = no_timing>
+    class static_refinement_second_model : 
+      public static_algorithm<static_refinement_second_model<Timing>, Timing>{
+      
+      friend class static_algorithm<static_refinement_second_model, Timing>;
+      void X() { PATTERN_LOG("\tX2"); }
+      void Y() { PATTERN_LOG("\tY2"); }      
+    };
+
+    // no_timing costs nothing: the skeleton keeps no state at all
+    static_assert(std::is_empty_v<static_refinement_first_model<> > &&
+		  std::is_empty_v<static_refinement_second_model<> >,
+		  "no_timing must not add to the algorithm's size");
+
+  } // end Template
+
+
+  namespace Visitor{
+
+    // Represent an operation to be performed on the elements 
+    // of an object structure.  Operations are performed without 
+    // polluting internal object
+
+    // A practical result of this separation is the ability to add
+    // new operations to existing object structures without modifying 
+    // those structures.
+
+    // In essence, the visitor allows one to add new virtual functions
+    // to a family of classes without modifying the classes themselves; 
+
+    class A;
+    class B;
+    class C;
+    class Parent;
+
+    // an interface for visitor
+
+    struct parent_element_visitor{
+
+      virtual void visit(A &a) const = 0;
+      virtual void visit(B &b) const = 0;
+      virtual void visit(C &c) const = 0;
+      virtual void visit(Parent &p) const = 0;
+      virtual ~parent_element_visitor() {};
+    };
+
+    // interface for a single element in hierarchy
+
+    struct parent_element{
+
+      virtual void accept (const parent_element_visitor& visitor) = 0;
+      virtual ~parent_element() {};
+    };
+
+    // class in hierarchy
+
+    class A : public parent_element{
+
+    public:
+      A() { PATTERN_LOG("\tcalled A"); }
+      
+      void accept(const parent_element_visitor & v)
+      {
+	v.visit(*this);
+      }
+    };
+
+    // class in hierarchy
+
+    class B : public parent_element{
+
+    public:
+      B() { PATTERN_LOG("\tcalled B"); }
+      
+      void accept(const parent_element_visitor & v)
+      {
+	v.visit(*this);
+      }
+    };
+
+    // class in hierarchy
+
+    class C : public parent_element{
+
+    public:
+      C() { PATTERN_LOG("\tcalled C"); }
+      
+      void accept(const parent_element_visitor & v)
+      {
+	v.visit(*this);
+      }
+    };
+
+    // container of all the objects in hierarchy
+
+    class Parent{
+
+    public: 
+      typedef std::vector<parent_element*>::const_iterator const_parent_collection_it;
+      typedef std::vector<parent_element*> parent_collection;
+
+      parent_collection& getElements()
+      {
+	return elements_;
+      }
+
+      Parent() 
+      {
+	elements_.push_back(new A());
+	elements_.push_back(new B());
+	elements_.push_back(new C());
+      }
+      ~Parent()
+      {
+	for (const_parent_collection_it it = elements_.begin(); 
+	     it != elements_.end(); ++it)
+	  { delete *it ; }                // call the destructors
+      }
+
+    private:
+      parent_collection elements_;
+    };
+
+
+    // a first concrete implementation of visitor
+
+    class parent_model_one_visitor : public parent_element_visitor{
+
+    public:
+      void visit(A &a) const { PATTERN_LOG("\tvisit A, model one");}
+      void visit(B &b) const { PATTERN_LOG("\tvisit B, model one");}
+      void visit(C &c) const { PATTERN_LOG("\tvisit B, model one");}
+
+      void visit(Parent &p) const {
+
+	Parent::parent_collection& elements = p.getElements();
+	for (Parent::const_parent_collection_it it = elements.begin(); 
+	     it != elements.end(); ++it){
+	  
+	  (*it)->accept(*this); // calling the visitor callback
+	};
+      }
+    };
+
+    // a second concrete implementation of visitor
+
+    class parent_model_two_visitor : public parent_element_visitor{
+
+    public:
+      void visit(A &a) const { PATTERN_LOG("\tvisit A, model two");}
+      void visit(B &b) const { PATTERN_LOG("\tvisit B, model two");}
+      void visit(C &c) const { PATTERN_LOG("\tvisit B, model two");}
+
+      void visit(Parent &p) const {
+
+	Parent::parent_collection& elements = p.getElements();
+	for (Parent::const_parent_collection_it it = elements.begin(); 
+	     it != elements.end(); ++it){
+	  
+	  (*it)->accept(*this); // calling the visitor callback
+	};
+      }
+    };
+
+    // Parent visited by several threads.  Each worker visits its own
+    // slice of the elements.  A visitor must declare whether it is 
+    // thread_safe: a safe one is shared by every worker, an unsafe one
+    // is default constructed once per worker and the copies are then 
+    // merge()d back into it, so accumulators need no locking
+
+    class parent_count_visitor : public parent_element_visitor{
+
+    public:
+      static constexpr bool thread_safe = false;  // plain counters
+
+      parent_count_visitor() : a(0), b(0), c(0) {};
+      void visit(A &) const { ++a; }
+      void visit(B &) const { ++b; }
+      void visit(C &) const { ++c; }
+      void visit(Parent &p) const {
+
+	Parent::parent_collection& elements = p.getElements();
+	for (Parent::const_parent_collection_it it = elements.begin(); 
+	     it != elements.end(); ++it)
+	  (*it)->accept(*this);
+      }
+
+      void merge(const parent_count_visitor & other)
+      {
+	a += other.a; b += other.b; c += other.c;
+      }
+
+      mutable std::size_t a, b, c;
+    };
+
+    // fixed set of threads running one job at a time, job(w) for
+    // every worker w; the caller is worker 0
+
+    class visit_pool{
+
+    public:
+      explicit visit_pool(unsigned int threads = 
+			  std::thread::hardware_concurrency()) : 
+	job_(0), generation_(0), pending_(0), stop_(false)
+      {
+	for (unsigned int w = 1; w < std::max(threads, 1u); ++w)
+	  workers_.emplace_back([this, w] { work(w); });
+      }
+
+      ~visit_pool()
+      {
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  stop_ = true;
+	}
+	start_.notify_all();
+	for (std::size_t i = 0; i < workers_.size(); ++i)
+	  workers_[i].join();
+      }
+
+      visit_pool(const visit_pool&) = delete;
+      visit_pool& operator=(const visit_pool&) = delete;
+
+      unsigned int size() const { return workers_.size() + 1; }
+
+      // returns once every worker is done, rethrows the first failure
+      void run(const std::function<void(unsigned int)>& job)
+      {
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  job_ = &job;
+	  pending_ = workers_.size();
+	  failure_ = nullptr;
+	  ++generation_;
+	}
+	start_.notify_all();
+
+	std::exception_ptr mine;
+	try { job(0); } catch (...) { mine = std::current_exception(); }
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_.wait(lock, [this] { return pending_ == 0; });
+	job_ = 0;
+	if (mine)
+	  std::rethrow_exception(mine);
+	if (failure_)
+	  std::rethrow_exception(failure_);
+      }
+
+    private:
+      void work(unsigned int w)
+      {
+	std::size_t seen = 0;
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;){
+	  start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+	  if (stop_)
+	    return;
+	  seen = generation_;
+	  const std::function<void(unsigned int)> * job = job_;
+	  lock.unlock();
+	  std::exception_ptr failed;
+	  try { (*job)(w); } catch (...) { failed = std::current_exception(); }
+	  lock.lock();
+	  if (failed && !failure_)
+	    failure_ = failed;
+	  if (--pending_ == 0)
+	    done_.notify_one();
+	}
+      }
+
+      std::vector<std::thread> workers_;
+      std::mutex mutex_;
+      std::condition_variable start_, done_;
+      const std::function<void(unsigned int)> * job_;
+      std::size_t generation_, pending_;
+      std::exception_ptr failure_;
+      bool stop_;
+    };
+
+    template <typename V>
+    void parallel_visit(Parent &p, V &visitor, visit_pool &pool)
+    {
+      static_assert(std::is_base_of_v<parent_element_visitor, V>,
+		    "a parent_element_visitor is needed");
+      static_assert(requires { { V::thread_safe } -> std::convertible_to<bool>; },
+		    "the visitor must declare static constexpr bool thread_safe");
+
+      Parent::parent_collection& elements = p.getElements();
+      const std::size_t n = elements.size(), parts = pool.size();
+      auto slice = [&elements, n, parts](unsigned int w, 
+					 const parent_element_visitor &v){
+	for (std::size_t i = n * w / parts; i < n * (w + 1) / parts; ++i)
+	  elements[i]->accept(v);
+      };
+
+      if constexpr (V::thread_safe)
+	pool.run([&](unsigned int w) { slice(w, visitor); });
+      else {
+	static_assert(std::is_default_constructible_v<V> &&
+		      requires (V &v, const V &o) { v.merge(o); },
+		      "a visitor that is not thread_safe is copied per "
+		      "worker and needs merge(const V&)");
+
+	// one cache line apart, the accumulators do not false share
+	struct alignas(64) local{ V v; };
+	std::vector<local> locals(parts - 1);
+	pool.run([&](unsigned int w) 
+		 { slice(w, w ? locals[w - 1].v : visitor); });
+	for (std::size_t w = 0; w < locals.size(); ++w)
+	  visitor.merge(locals[w].v);
+      }
+    }
+
+    // the same hierarchy held by value, no double dispatch: an element
+    // is a variant and std::visit picks the overload through a single
+    // jump table
+
+    typedef std::variant<A, B, C> element;
+
+    // builds a visitor out of lambdas, one per element type
+
+    template <typename... F>
+    struct overloaded : F... { using F::operator()...; };
+
+    template <typename... F> overloaded(F...) -> overloaded<F...>;
+
+    // container of the elements, contiguous and in insertion order
+
+    class flat_parent{
+
+    public:
+      typedef std::vector<element> element_collection;
+
+      flat_parent() {};
+      explicit flat_parent(std::size_t capacity) { elements_.reserve(capacity); }
+
+      template <typename T>
+      void add(const T& e) { elements_.emplace_back(e); }
+
+      element_collection& getElements() { return elements_; }
+      std::size_t size() const { return elements_.size(); }
+
+      // f is called with A&, B& or C&
+
+      template <typename F>
+      void visit(F&& f)
+      {
+	for (element& e : elements_)
+	  std::visit(f, e);
+      }
+
+      // the existing visitors, at one virtual call per element
+
+      void accept(const parent_element_visitor& v)
+      {
+	visit([&v](auto& e) { v.visit(e); });
+      }
+
+    private:
+      element_collection elements_;
+    };
+
+    // container of the elements grouped by type: visiting is one loop
+    // per type, without any dispatch inside.  The order of elements of
+    // different types is lost
+
+    class sorted_parent{
+
+    public:
+      template <typename T>
+      void add(const T& e) { getElements<T>().push_back(e); }
+
+      template <typename T>
+      std::vector<T>& getElements() { return std::get<std::vector<T> >(elements_); }
+
+      std::size_t size() const
+      {
+	return std::apply([](const auto&... v) { return (v.size() + ...); }, 
+			  elements_);
+      }
+
+      template <typename F>
+      void visit(F&& f)
+      {
+	std::apply([&f](auto&... v) { (batch(v, f), ...); }, elements_);
+      }
+
+      void accept(const parent_element_visitor& v)
+      {
+	visit([&v](auto& e) { v.visit(e); });
+      }
+
+    private:
+      template <typename T, typename F>
+      static void batch(std::vector<T>& v, F& f)
+      {
+	for (T& e : v)
+	  f(e);
+      }
+
+      std::tuple<std::vector<A>, std::vector<B>, std::vector<C> > elements_;
+    };
+
+  };     // end visitor
+
+
+  namespace Interpreter{
+
+    // used to create grammars in C++
+    //
+    // I found this article, pretty inspiring
+    //
+    // http://www.peachpit.com/articles/article.aspx?p=467371
+    //
+
+    // http://www.peachpit.com/content/images/art_morris20_cinterpret/elementLinks/source.zip
+
+    // Arithmetic and boolean rules over named variables, e.g.
+    //
+    //   price * qty > 100 && !(region == 3) ? price * qty * 0.9 : 0
+    //
+    // Every value is a double; comparisons and logic give 0 or 1.
+    // The grammar, loosest binding first:
+    //
+    //   rule        := or [ '?' rule ':' rule ]
+    //   or          := and { '||' and }
+    //   and         := equality { '&&' equality }
+    //   equality    := relational { ( '==' | '!=' ) relational }
+    //   relational  := additive { ( '<' | '<=' | '>' | '>=' ) additive }
+    //   additive    := term { ( '+' | '-' ) term }
+    //   term        := unary { ( '*' | '/' | '%' ) unary }
+    //   unary       := ( '-' | '+' | '!' ) unary | primary
+    //   primary     := number | name | '(' rule ')'
+    //
+    // A syntax_tree is the classic interpreter, one expression object
+    // per grammar rule, interpret()ed by walking the tree.  compile()
+    // turns it into a program: constants are folded, repeated
+    // subexpressions computed once and the rest laid out as register
+    // bytecode, run by a single loop.
+
+    enum class opcode : std::uint8_t { 
+      NEG, NOT, ADD, SUB, MUL, DIV, MOD, 
+      LT, LE, GT, GE, EQ, NE, AND, OR, SELECT 
+    };
+
+    // the meaning of every operator, shared by the tree, the folding
+    // and the bytecode loop
+
+    inline double evaluate(opcode op, double a, double b = 0, double c = 0)
+    {
+      switch (op){
+      case opcode::NEG: return -a;
+      case opcode::NOT: return a == 0;
+      case opcode::ADD: return a + b;
+      case opcode::SUB: return a - b;
+      case opcode::MUL: return a * b;
+      case opcode::DIV: return a / b;
+      case opcode::MOD: return std::fmod(a, b);
+      case opcode::LT:  return a < b;
+      case opcode::LE:  return a <= b;
+      case opcode::GT:  return a > b;
+      case opcode::GE:  return a >= b;
+      case opcode::EQ:  return a == b;
+      case opcode::NE:  return a != b;
+      case opcode::AND: return a != 0 && b != 0;
+      case opcode::OR:  return a != 0 || b != 0;
+      case opcode::SELECT: return a != 0 ? b : c;
+      default: return a;
+      }
+    }
+
+    // Registers are numbered constants first, then variables, then
+    // one per instruction: instruction i writes register first + i,
+    // from registers a and b (and c, for a select)
+
+    struct instruction{
+
+      opcode op;
+      std::uint16_t a, b, c;
+    };
+
+    // compiled form of a rule, immutable once built
+
+    class program{
+
+    public:
+      program() : result_(0) {};
+
+      // vars[i] is the value of variables()[i]
+      double run(const double * vars) const
+      {
+	const std::size_t n = registers();
+	if (n <= stack_registers_){
+	  double r[stack_registers_];
+	  return run(vars, r);
+	}
+	std::vector<double> r(n);
+	return run(vars, r.data());
+      }
+
+      double run(std::span<const double> vars) const { return run(vars.data()); }
+
+      // Batch mode, over columns: columns[i] holds the rows of 
+      // variables()[i], out[j] receives the value of row j.  Rows go 
+      // through in chunks, every instruction looping over a whole 
+      // chunk, which the compiler vectorizes; the dispatch is paid 
+      // once per chunk instead of once per row.
+
+      static constexpr std::size_t chunk = 256;
+
+      void run(std::span<const double * const> columns, std::span<double> out) const
+      {
+	if (columns.size() < variables_.size())
+	  throw std::invalid_argument("interpreter: a column per variable");
+
+	// where each register is read from, and room for the computed ones
+	std::vector<const double *> from(registers());
+	std::vector<double> scratch((constants_.size() + code_.size()) * chunk);
+	for (std::size_t k = 0; k < constants_.size(); ++k){
+	  std::fill_n(scratch.data() + k * chunk, chunk, constants_[k]);
+	  from[k] = scratch.data() + k * chunk;
+	}
+	double * t = scratch.data() + constants_.size() * chunk;
+	for (std::size_t i = 0; i < code_.size(); ++i)
+	  from[first() + i] = t + i * chunk;
+
+	for (std::size_t row = 0; row < out.size(); row += chunk){
+	  const std::size_t m = std::min(chunk, out.size() - row);
+	  for (std::size_t v = 0; v < variables_.size(); ++v)
+	    from[constants_.size() + v] = columns[v] + row;
+	  run_chunk(from.data(), t, m);
+	  std::copy_n(from[result_], m, out.data() + row);
+	}
+      }
+
+      const std::vector<std::string>& variables() const { return variables_; }
+      std::span<const instruction> code() const { return code_; }
+      std::span<const double> constants() const { return constants_; }
+
+      std::size_t first() const { return constants_.size() + variables_.size(); }
+      std::size_t registers() const { return first() + code_.size(); }
+      std::size_t result() const { return result_; }
+
+      // one line per instruction, r<i> = op operands
+      void dump(std::ostream & os) const
+      {
+	static const char * names[] = { "neg", "not", "add", "sub", "mul", 
+					"div", "mod", "lt", "le", "gt", "ge", 
+					"eq", "ne", "and", "or", "select" };
+	for (std::size_t i = 0; i < code_.size(); ++i){
+	  const instruction & in = code_[i];
+	  os << "\tr" << i << " = " << names[std::size_t(in.op)] << " ";
+	  operand(os, in.a);
+	  if (in.op >= opcode::ADD)
+	    operand(os << ", ", in.b);
+	  if (in.op == opcode::SELECT)
+	    operand(os << ", ", in.c);
+	  os << '\n';
+	}
+	operand(os << "\treturn ", result_);
+	os << '\n';
+      }
+
+    private:
+      friend class compiler;
+
+      static constexpr std::size_t stack_registers_ = 64;
+
+      double run(const double * vars, double * r) const
+      {
+	std::copy(constants_.begin(), constants_.end(), r);
+	std::copy(vars, vars + variables_.size(), r + constants_.size());
+
+	const instruction * code = code_.data();
+	const std::size_t n = code_.size();
+	double * t = r + first();
+	for (std::size_t i = 0; i < n; ++i){
+	  const instruction in = code[i];
+	  switch (in.op){
+	  case opcode::NEG: t[i] = -r[in.a]; break;
+	  case opcode::NOT: t[i] = r[in.a] == 0; break;
+	  case opcode::ADD: t[i] = r[in.a] + r[in.b]; break;
+	  case opcode::SUB: t[i] = r[in.a] - r[in.b]; break;
+	  case opcode::MUL: t[i] = r[in.a] * r[in.b]; break;
+	  case opcode::DIV: t[i] = r[in.a] / r[in.b]; break;
+	  case opcode::MOD: t[i] = std::fmod(r[in.a], r[in.b]); break;
+	  case opcode::LT: t[i] = r[in.a] < r[in.b]; break;
+	  case opcode::LE: t[i] = r[in.a] <= r[in.b]; break;
+	  case opcode::GT: t[i] = r[in.a] > r[in.b]; break;
+	  case opcode::GE: t[i] = r[in.a] >= r[in.b]; break;
+	  case opcode::EQ: t[i] = r[in.a] == r[in.b]; break;
+	  case opcode::NE: t[i] = r[in.a] != r[in.b]; break;
+	  case opcode::AND: t[i] = (r[in.a] != 0) & (r[in.b] != 0); break;
+	  case opcode::OR: t[i] = (r[in.a] != 0) | (r[in.b] != 0); break;
+	  case opcode::SELECT: t[i] = r[in.a] != 0 ? r[in.b] : r[in.c]; break;
+	  default: __builtin_unreachable();
+	  }
+	}
+	return r[result_];
+      }
+
+      // every instruction over m rows, instruction i into t + i * chunk
+      void run_chunk(const double * const * r, double * t, std::size_t m) const
+      {
+	for (std::size_t i = 0; i < code_.size(); ++i){
+	  const instruction in = code_[i];
+	  double * __restrict o = t + i * chunk;
+	  const double * __restrict x = r[in.a];
+	  const double * __restrict y = r[in.b];
+	  const double * __restrict z = r[in.c];
+	  auto rows = [o, m](auto f){ 
+	    for (std::size_t j = 0; j < m; ++j) 
+	      o[j] = f(j); 
+	  };
+	  switch (in.op){
+	  case opcode::NEG: rows([x](std::size_t j) { return -x[j]; }); break;
+	  case opcode::NOT: rows([x](std::size_t j) { return x[j] == 0; }); break;
+	  case opcode::ADD: rows([x, y](std::size_t j) { return x[j] + y[j]; }); break;
+	  case opcode::SUB: rows([x, y](std::size_t j) { return x[j] - y[j]; }); break;
+	  case opcode::MUL: rows([x, y](std::size_t j) { return x[j] * y[j]; }); break;
+	  case opcode::DIV: rows([x, y](std::size_t j) { return x[j] / y[j]; }); break;
+	  case opcode::MOD: 
+	    rows([x, y](std::size_t j) { return std::fmod(x[j], y[j]); }); break;
+	  case opcode::LT: rows([x, y](std::size_t j) { return x[j] < y[j]; }); break;
+	  case opcode::LE: rows([x, y](std::size_t j) { return x[j] <= y[j]; }); break;
+	  case opcode::GT: rows([x, y](std::size_t j) { return x[j] > y[j]; }); break;
+	  case opcode::GE: rows([x, y](std::size_t j) { return x[j] >= y[j]; }); break;
+	  case opcode::EQ: rows([x, y](std::size_t j) { return x[j] == y[j]; }); break;
+	  case opcode::NE: rows([x, y](std::size_t j) { return x[j] != y[j]; }); break;
+	  case opcode::AND: 
+	    rows([x, y](std::size_t j) { return (x[j] != 0) & (y[j] != 0); }); break;
+	  case opcode::OR: 
+	    rows([x, y](std::size_t j) { return (x[j] != 0) | (y[j] != 0); }); break;
+	  case opcode::SELECT: 
+	    rows([x, y, z](std::size_t j) { return x[j] != 0 ? y[j] : z[j]; }); break;
+	  default: __builtin_unreachable();
+	  }
+	}
+      }
 
-    class strategy{
+      void operand(std::ostream & os, std::size_t reg) const
+      {
+	if (reg < constants_.size())
+	  os << constants_[reg];
+	else if (reg < first())
+	  os << variables_[reg - constants_.size()];
+	else
+	  os << "r" << reg - first();
+      }
 
-    public:
-      virtual void do_it() = 0;
+      std::vector<instruction> code_;
+      std::vector<double> constants_;
+      std::vector<std::string> variables_;
+      std::uint16_t result_;
     };
 
-    class algo1 : public strategy{
+    // Builds a program as the tree is walked.  Values are numbered: an
+    // operation already emitted with the same operands gives back its
+    // value, one on constants only is computed right away.  Dead
+    // instructions (the branch a folded condition threw away) and 
+    // unused constants are dropped at the end.
 
-      void do_it() { std::cout <<"\tcalling algo1"<<std::endl;}
-    };
+    class compiler{
 
-    class algo2 : public strategy{
+      // while compiling an operand is tagged with what it refers to
+      enum : std::uint32_t { TEMPORARY = 0, VARIABLE = 1, CONSTANT = 2 };
+      static constexpr unsigned int tag_shift_ = 16;
 
-      void do_it() { std::cout <<"\tcalling algo2"<<std::endl;}
-    };
+    public:
+      struct value{
 
-    
-    class testbed{
+	bool constant;
+	double k;
+	std::uint32_t ref;      // tagged, when not constant
+      };
 
-    public: 
+      value constant(double k) { return value{ true, k, 0 }; }
 
-      testbed() : strategy_(NULL) {};
-      void choose_strategy (unsigned int what)
+      value variable(std::size_t index)
       {
-	strategy * tmp;
+	return value{ false, 0, VARIABLE << tag_shift_ | std::uint32_t(index) };
+      }
 
-	switch (what){
-	case ALGO1 : 
-	  tmp = new algo1(); 
-	  delete strategy_;
-	  strategy_ = tmp;
-	  break;
-	case ALGO2 : 
-	    tmp = new algo2();
-	    delete strategy_;
-	    strategy_ = tmp;
-	    break;
-	default:
-	  strategy_ = new algo1(); break;
+      value apply(opcode op, value a, value b = value{ true, 0, 0 }, 
+		  value c = value{ true, 0, 0 })
+      {
+	if (op == opcode::SELECT){
+	  if (a.constant)
+	    return a.k != 0 ? b : c;
+	  if (!b.constant && !c.constant && b.ref == c.ref)
+	    return b;
 	}
-      strategy_->do_it();
+	else if (unary(op)){
+	  if (a.constant)
+	    return constant(evaluate(op, a.k));
+	  if (op == opcode::NOT && a.ref >> tag_shift_ == TEMPORARY){
+	    const tagged & in = code_[a.ref];  // !(x == y) is x != y
+	    if (in.op == opcode::EQ || in.op == opcode::NE)
+	      return emit(in.op == opcode::EQ ? opcode::NE : opcode::EQ, 
+			  in.a, in.b, in.c);
+	  }
+	}
+	else{
+	  if (a.constant && b.constant)
+	    return constant(evaluate(op, a.k, b.k));
+	  if (op == opcode::AND && ((a.constant && a.k == 0) || 
+				    (b.constant && b.k == 0)))
+	    return constant(0);
+	  if (op == opcode::OR && ((a.constant && a.k != 0) || 
+				   (b.constant && b.k != 0)))
+	    return constant(1);
+	}
+	std::uint32_t ra = ref(a), rb = 0, rc = 0;
+	if (!unary(op))
+	  rb = ref(b);
+	if (op == opcode::SELECT)
+	  rc = ref(c);
+	if (commutative(op) && rb < ra)
+	  std::swap(ra, rb);
+	return emit(op, ra, rb, rc);
       }
-    private:      
-      strategy * strategy_;
-    };   
-  } // end Strategy
 
-  namespace Template{
-    
-    // Define the skeleton of an algorithm 
-    // deferring some steps to client subclasses
-     
-    class algorithm_base{
+      program finish(value result, std::vector<std::string> variables)
+      {
+	program p;
+	p.variables_ = std::move(variables);
+	const std::uint32_t last = ref(result);
+
+	// keep what the result depends on
+	std::vector<bool> live(code_.size(), false);
+	std::vector<bool> used(constants_.size(), false);
+	auto mark = [&](std::uint32_t r){
+	  if (r >> tag_shift_ == TEMPORARY)
+	    live[r] = true;
+	  else if (r >> tag_shift_ == CONSTANT)
+	    used[r & 0xffff] = true;
+	};
+	mark(last);
+	for (std::size_t i = code_.size(); i-- > 0; )
+	  if (live[i]){
+	    mark(code_[i].a);
+	    if (!unary(code_[i].op))
+	      mark(code_[i].b);
+	    if (code_[i].op == opcode::SELECT)
+	      mark(code_[i].c);
+	  }
+
+	// then number the registers densely
+	std::vector<std::uint32_t> renamed_constant(constants_.size());
+	for (std::size_t k = 0; k < constants_.size(); ++k)
+	  if (used[k]){
+	    renamed_constant[k] = p.constants_.size();
+	    p.constants_.push_back(constants_[k]);
+	  }
+	std::vector<std::uint32_t> renamed(code_.size());
+	std::size_t n = 0;
+	for (std::size_t i = 0; i < code_.size(); ++i)
+	  if (live[i])
+	    renamed[i] = p.first() + n++;
+	if (p.first() + n > 0xffff)
+	  throw std::length_error("interpreter: rule too large");
+
+	auto final = [&](std::uint32_t r) -> std::uint16_t {
+	  switch (r >> tag_shift_){
+	  case TEMPORARY: return renamed[r];
+	  case VARIABLE: return p.constants_.size() + (r & 0xffff);
+	  default: return renamed_constant[r & 0xffff];
+	  }
+	};
+	for (std::size_t i = 0; i < code_.size(); ++i)
+	  if (live[i]){
+	    const tagged & in = code_[i];
+	    p.code_.push_back(instruction{ in.op, final(in.a), 
+		  unary(in.op) ? std::uint16_t(0) : final(in.b), 
+		  in.op == opcode::SELECT ? final(in.c) : std::uint16_t(0) });
+	  }
+	p.result_ = final(last);
+	return p;
+      }
 
-      void a() { std::cout << "\tA" << std::endl; }
-      void b() { std::cout << "\tB" << std::endl; }
-      void c() { std::cout << "\tC" << std::endl; }
-      virtual void X() = 0;
-      virtual void Y() = 0;
+    private:
+      struct tagged{
 
-    public:
+	opcode op;
+	std::uint32_t a, b, c;
+      };
 
-      void execute() { a(); X(); b();  Y(); c();}
-    };
-      
-    class algorithm_refinement_first_model : public algorithm_base{
-      
-      void X() { std::cout << "\tX1" << std::endl; }
-      void Y() { std::cout << "\tY1" << std::endl; }      
-    };
+      static bool unary(opcode op) 
+      { 
+	return op == opcode::NEG || op == opcode::NOT; 
+      }
 
-    class algorithm_refinement_second_model :public algorithm_base{
-      
-      void X() { std::cout << "\tX2" << std::endl; }
-      void Y() { std::cout << "\tY2" << std::endl; }      
+      static bool commutative(opcode op)
+      {
+	return op == opcode::ADD || op == opcode::MUL || op == opcode::EQ ||
+	  op == opcode::NE || op == opcode::AND || op == opcode::OR;
+      }
+
+      std::uint32_t ref(value v)
+      {
+	if (!v.constant)
+	  return v.ref;
+	const std::uint64_t bits = std::bit_cast<std::uint64_t>(v.k);
+	auto found = constant_index_.find(bits);
+	if (found != constant_index_.end())
+	  return found->second;
+	if (constants_.size() >= 0xffff)
+	  throw std::length_error("interpreter: rule too large");
+	const std::uint32_t r = CONSTANT << tag_shift_ | constants_.size();
+	constants_.push_back(v.k);
+	constant_index_.emplace(bits, r);
+	return r;
+      }
+
+      value emit(opcode op, std::uint32_t a, std::uint32_t b, std::uint32_t c)
+      {
+	const std::uint64_t key = std::uint64_t(op) << 54 | 
+	  std::uint64_t(a) << 36 | std::uint64_t(b) << 18 | c;
+	auto found = numbered_.find(key);
+	if (found != numbered_.end())
+	  return value{ false, 0, found->second };
+	if (code_.size() >= 0xffff)
+	  throw std::length_error("interpreter: rule too large");
+	const std::uint32_t r = TEMPORARY << tag_shift_ | code_.size();
+	code_.push_back(tagged{ op, a, b, c });
+	numbered_.emplace(key, r);
+	return value{ false, 0, r };
+      }
+
+      std::vector<tagged> code_;
+      std::vector<double> constants_;
+      std::unordered_map<std::uint64_t, std::uint32_t> numbered_;
+      std::unordered_map<std::uint64_t, std::uint32_t> constant_index_;
     };
 
-  } // end Template
+    // abstract expression, one subclass per kind of grammar rule
 
+    class expression{
 
-  namespace Visitor{
+    public:
+      virtual double interpret(const double * vars) const = 0;
+      virtual compiler::value compile(compiler & c) const = 0;
+      virtual ~expression() {};
+    };
 
-    // Represent an operation to be performed on the elements 
-    // of an object structure.  Operations are performed without 
-    // polluting internal object
+    typedef std::unique_ptr<expression> expression_ptr;
 
-    // A practical result of this separation is the ability to add
-    // new operations to existing object structures without modifying 
-    // those structures.
+    // terminal expressions
 
-    // In essence, the visitor allows one to add new virtual functions
-    // to a family of classes without modifying the classes themselves; 
+    class number : public expression{
 
-    class A;
-    class B;
-    class C;
-    class Parent;
+    public:
+      explicit number(double value) : value_(value) {};
+      double interpret(const double *) const { return value_; }
+      compiler::value compile(compiler & c) const { return c.constant(value_); }
 
-    // an interface for visitor
+    private:
+      double value_;
+    };
 
-    struct parent_element_visitor{
+    class variable : public expression{
 
-      virtual void visit(A &a) const = 0;
-      virtual void visit(B &b) const = 0;
-      virtual void visit(C &c) const = 0;
-      virtual void visit(Parent &p) const = 0;
-      virtual ~parent_element_visitor() {};
+    public:
+      explicit variable(std::size_t index) : index_(index) {};
+      double interpret(const double * vars) const { return vars[index_]; }
+      compiler::value compile(compiler & c) const { return c.variable(index_); }
+
+    private:
+      std::size_t index_;
     };
 
-    // interface for a single element in hierarchy
+    // nonterminal expressions
 
-    struct parent_element{
+    class unary_expression : public expression{
 
-      virtual void accept (const parent_element_visitor& visitor) = 0;
-      virtual ~parent_element() {};
+    public:
+      unary_expression(opcode op, expression_ptr operand) : 
+	op_(op), operand_(std::move(operand)) {};
+
+      double interpret(const double * vars) const 
+      { 
+	return evaluate(op_, operand_->interpret(vars)); 
+      }
+
+      compiler::value compile(compiler & c) const 
+      { 
+	return c.apply(op_, operand_->compile(c)); 
+      }
+
+    private:
+      opcode op_;
+      expression_ptr operand_;
     };
 
-    // class in hierarchy
+    // Binary operators of one precedence, applied left to right: 
+    // a - b + c is one node with the links (-, b) and (+, c), so a
+    // chain of any length is a loop rather than a tree as deep as 
+    // it is long.
 
-    class A : public parent_element{
+    class chain_expression : public expression{
 
     public:
-      A() { std::cout << "\tcalled A" <<std::endl; }
-      
-      void accept(const parent_element_visitor & v)
+      typedef std::vector<std::pair<opcode, expression_ptr> > links;
+
+      chain_expression(expression_ptr first, links rest) : 
+	first_(std::move(first)), rest_(std::move(rest)) {};
+
+      double interpret(const double * vars) const 
       {
-	v.visit(*this);
+	double a = first_->interpret(vars);
+	for (const auto & [op, e] : rest_)
+	  if (op == opcode::AND && a == 0)
+	    a = 0;
+	  else if (op == opcode::OR && a != 0)
+	    a = 1;
+	  else
+	    a = evaluate(op, a, e->interpret(vars));
+	return a;
       }
-    };
 
-    // class in hierarchy
+      compiler::value compile(compiler & c) const 
+      { 
+	compiler::value a = first_->compile(c);
+	for (const auto & [op, e] : rest_)
+	  a = c.apply(op, a, e->compile(c));
+	return a;
+      }
 
-    class B : public parent_element{
+    private:
+      expression_ptr first_;
+      links rest_;
+    };
+
+    class conditional_expression : public expression{
 
     public:
-      B() { std::cout << "\tcalled B" <<std::endl; }
-      
-      void accept(const parent_element_visitor & v)
+      conditional_expression(expression_ptr condition, expression_ptr then, 
+			     expression_ptr otherwise) : 
+	condition_(std::move(condition)), then_(std::move(then)), 
+	otherwise_(std::move(otherwise)) {};
+
+      double interpret(const double * vars) const 
       {
-	v.visit(*this);
+	return condition_->interpret(vars) != 0 ? 
+	  then_->interpret(vars) : otherwise_->interpret(vars);
+      }
+
+      // both branches are computed, rules have no side effects
+      compiler::value compile(compiler & c) const 
+      { 
+	compiler::value a = condition_->compile(c);
+	compiler::value b = then_->compile(c);
+	return c.apply(opcode::SELECT, a, b, otherwise_->compile(c)); 
       }
+
+    private:
+      expression_ptr condition_, then_, otherwise_;
     };
 
-    // class in hierarchy
+    // A parsed rule.  Variables are numbered in order of first use, 
+    // after the ones given as known; a malformed rule throws 
+    // std::invalid_argument naming the offset.  So does a rule nested
+    // deeper than max_depth, in parentheses, unary operators or ?:, 
+    // as parsing, evaluating and deleting the tree all recurse once
+    // per level.  Chains of binary operators are not bounded, each
+    // is a single node whatever its length.
 
-    class C : public parent_element{
+    class syntax_tree{
 
     public:
-      C() { std::cout << "\tcalled C" <<std::endl; }
-      
-      void accept(const parent_element_visitor & v)
+      static const std::size_t max_depth = 256;
+
+      explicit syntax_tree(std::string_view text, 
+			   std::vector<std::string> known = {}) : 
+	text_(text), at_(0), depth_(0), variables_(std::move(known))
       {
-	v.visit(*this);
+	root_ = rule();
+	skip();
+	if (at_ != text_.size())
+	  fail("unexpected input");
       }
-    };
 
-    // container of all the objects in hierarchy
+      double interpret(const double * vars) const { return root_->interpret(vars); }
+      double interpret(std::span<const double> vars) const 
+      { 
+	return interpret(vars.data()); 
+      }
 
-    class Parent{
+      const std::vector<std::string>& variables() const { return variables_; }
 
-    public: 
-      typedef std::vector<parent_element*>::const_iterator const_parent_collection_it;
-      typedef std::vector<parent_element*> parent_collection;
+      program compile() const
+      {
+	compiler c;
+	return c.finish(root_->compile(c), variables_);
+      }
 
-      parent_collection& getElements()
+    private:
+      expression_ptr rule()
       {
-	return elements_;
+	expression_ptr e = logical_or();
+	if (!accept("?"))
+	  return e;
+	nested n(*this);
+	expression_ptr then = rule();
+	if (!accept(":"))
+	  fail("expected ':'");
+	return expression_ptr(new conditional_expression(std::move(e), 
+							 std::move(then), 
+							 rule()));
       }
 
-      Parent() 
+      expression_ptr logical_or()
       {
-	elements_.push_back(new A());
-	elements_.push_back(new B());
-	elements_.push_back(new C());
+	chain c(logical_and());
+	while (accept("||"))
+	  c.add(opcode::OR, logical_and());
+	return c.done();
       }
-      ~Parent()
+
+      expression_ptr logical_and()
       {
-	for (const_parent_collection_it it = elements_.begin(); 
-	     it != elements_.end(); ++it)
-	  { delete *it ; }                // call the destructors
+	chain c(equality());
+	while (accept("&&"))
+	  c.add(opcode::AND, equality());
+	return c.done();
       }
 
-    private:
-      parent_collection elements_;
-    };
+      expression_ptr equality()
+      {
+	chain c(relational());
+	for (;;)
+	  if (accept("=="))
+	    c.add(opcode::EQ, relational());
+	  else if (accept("!="))
+	    c.add(opcode::NE, relational());
+	  else
+	    return c.done();
+      }
 
+      expression_ptr relational()
+      {
+	chain c(additive());
+	for (;;)
+	  if (accept("<="))
+	    c.add(opcode::LE, additive());
+	  else if (accept(">="))
+	    c.add(opcode::GE, additive());
+	  else if (accept("<"))
+	    c.add(opcode::LT, additive());
+	  else if (accept(">"))
+	    c.add(opcode::GT, additive());
+	  else
+	    return c.done();
+      }
 
-    // a first concrete implementation of visitor
+      expression_ptr additive()
+      {
+	chain c(term());
+	for (;;)
+	  if (accept("+"))
+	    c.add(opcode::ADD, term());
+	  else if (accept("-"))
+	    c.add(opcode::SUB, term());
+	  else
+	    return c.done();
+      }
 
-    class parent_model_one_visitor : public parent_element_visitor{
+      expression_ptr term()
+      {
+	chain c(unary());
+	for (;;)
+	  if (accept("*"))
+	    c.add(opcode::MUL, unary());
+	  else if (accept("/"))
+	    c.add(opcode::DIV, unary());
+	  else if (accept("%"))
+	    c.add(opcode::MOD, unary());
+	  else
+	    return c.done();
+      }
 
-    public:
-      void visit(A &a) const { std::cout << "\tvisit A, model one" << std::endl;}
-      void visit(B &b) const { std::cout << "\tvisit B, model one" << std::endl;}
-      void visit(C &c) const { std::cout << "\tvisit B, model one" << std::endl;}
+      expression_ptr unary()
+      {
+	opcode op;
+	if (accept("-"))
+	  op = opcode::NEG;
+	else if (accept("!"))
+	  op = opcode::NOT;
+	else if (accept("+")){
+	  nested n(*this);
+	  return unary();
+	}
+	else
+	  return primary();
+	nested n(*this);
+	return expression_ptr(new unary_expression(op, unary()));
+      }
 
-      void visit(Parent &p) const {
+      expression_ptr primary()
+      {
+	skip();
+	if (accept("(")){
+	  nested n(*this);
+	  expression_ptr e = rule();
+	  if (!accept(")"))
+	    fail("expected ')'");
+	  return e;
+	}
+	if (at_ < text_.size() && (std::isdigit((unsigned char)text_[at_]) || 
+				   text_[at_] == '.')){
+	  double value;
+	  std::from_chars_result r = std::from_chars(text_.data() + at_, 
+						     text_.data() + text_.size(), 
+						     value);
+	  if (r.ec != std::errc())
+	    fail("bad number");
+	  at_ = r.ptr - text_.data();
+	  return expression_ptr(new number(value));
+	}
+	if (at_ < text_.size() && (std::isalpha((unsigned char)text_[at_]) || 
+				   text_[at_] == '_')){
+	  std::size_t from = at_;
+	  while (at_ < text_.size() && (std::isalnum((unsigned char)text_[at_]) || 
+					text_[at_] == '_'))
+	    ++at_;
+	  std::string_view name = text_.substr(from, at_ - from);
+	  std::size_t i = std::find(variables_.begin(), variables_.end(), name) - 
+	    variables_.begin();
+	  if (i == variables_.size())
+	    variables_.push_back(std::string(name));
+	  return expression_ptr(new variable(i));
+	}
+	fail("expected a number, a name or '('");
+      }
 
-	Parent::parent_collection& elements = p.getElements();
-	for (Parent::const_parent_collection_it it = elements.begin(); 
-	     it != elements.end(); ++it){
-	  
-	  (*it)->accept(*this); // calling the visitor callback
-	};
+      // the operands of one precedence level as they are parsed
+      struct chain{
+
+	explicit chain(expression_ptr first) : first_(std::move(first)) {};
+
+	void add(opcode op, expression_ptr e) 
+	{ 
+	  rest_.emplace_back(op, std::move(e)); 
+	}
+
+	expression_ptr done()
+	{
+	  if (rest_.empty())
+	    return std::move(first_);
+	  return expression_ptr(new chain_expression(std::move(first_), 
+						     std::move(rest_)));
+	}
+
+	expression_ptr first_;
+	chain_expression::links rest_;
+      };
+
+      // one level of recursion of the parser, for as long as it lives
+      struct nested{
+
+	explicit nested(syntax_tree & t) : t_(t)
+	{
+	  if (t_.depth_ == max_depth)
+	    t_.fail("rule nested too deep");
+	  ++t_.depth_;
+	}
+	~nested() { --t_.depth_; }
+
+	syntax_tree & t_;
+      };
+
+      void skip()
+      {
+	while (at_ < text_.size() && std::isspace((unsigned char)text_[at_]))
+	  ++at_;
+      }
+
+      // consumes token if it comes next; longer operators are tried
+      // first, "<=" before "<"
+      bool accept(std::string_view token)
+      {
+	skip();
+	if (text_.substr(at_, token.size()) != token)
+	  return false;
+	at_ += token.size();
+	return true;
+      }
+
+      [[noreturn]] void fail(const char * what) const
+      {
+	throw std::invalid_argument("interpreter: " + std::string(what) + 
+				    " at offset " + std::to_string(at_));
       }
+
+      std::string_view text_;
+      std::size_t at_;
+      std::size_t depth_;     // of the parser's recursion
+      std::vector<std::string> variables_;
+      expression_ptr root_;
     };
 
-    // a second concrete implementation of visitor
+    // Compiled rules by text, shared: programs are immutable, so one
+    // copy serves every thread and every tenant using the same rule.
+    // Texts are keyed normalized, with only the spaces that change
+    // how the rule splits into tokens, but the caller's text is what
+    // gets compiled, so errors point into it.  The cache is split in
+    // shards, each a least recently used list behind its own mutex;
+    // at most capacity programs are kept.  A rule is compiled outside
+    // the lock; two threads missing on the same text both compile it,
+    // the first one stored wins.
 
-    class parent_model_two_visitor : public parent_element_visitor{
+    class program_cache{
 
     public:
-      void visit(A &a) const { std::cout << "\tvisit A, model two" << std::endl;}
-      void visit(B &b) const { std::cout << "\tvisit B, model two" << std::endl;}
-      void visit(C &c) const { std::cout << "\tvisit B, model two" << std::endl;}
+      typedef std::shared_ptr<const program> program_ptr;
 
-      void visit(Parent &p) const {
+      struct cache_stats{
 
-	Parent::parent_collection& elements = p.getElements();
-	for (Parent::const_parent_collection_it it = elements.begin(); 
-	     it != elements.end(); ++it){
-	  
-	  (*it)->accept(*this); // calling the visitor callback
+	std::uint64_t hits, misses, evictions;
+	std::size_t size;
+	double hit_rate;
+	std::chrono::nanoseconds compile_time;  // spent on misses
+	std::chrono::nanoseconds saved;         // not spent, thanks to hits
+      };
+
+      explicit program_cache(std::size_t capacity = 1024, 
+			     std::size_t shards = 16) : 
+	shards_(std::max<std::size_t>(1, std::min(shards, capacity))),
+	per_shard_(std::max<std::size_t>(1, capacity / shards_.size())),
+	hits_(0), misses_(0), evictions_(0), compile_ns_(0), saved_ns_(0) {};
+
+      // the compiled rule, throws std::invalid_argument when malformed
+      program_ptr get(std::string_view text)
+      {
+	std::string key = normalize(text);
+	shard & s = shards_[std::hash<std::string>()(key) % shards_.size()];
+	{
+	  std::lock_guard<std::mutex> lock(s.mutex);
+	  auto found = s.index.find(key);
+	  if (found != s.index.end()){
+	    s.lru.splice(s.lru.begin(), s.lru, found->second);
+	    hits_.fetch_add(1, std::memory_order_relaxed);
+	    saved_ns_.fetch_add(found->second->compile_ns, std::memory_order_relaxed);
+	    return found->second->compiled;
+	  }
+	}
+
+	std::chrono::steady_clock::time_point start = 
+	  std::chrono::steady_clock::now();
+	program_ptr compiled = std::make_shared<const program>(syntax_tree(text).compile());
+	const std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+	  (std::chrono::steady_clock::now() - start).count();
+	misses_.fetch_add(1, std::memory_order_relaxed);
+	compile_ns_.fetch_add(ns, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(s.mutex);
+	auto found = s.index.find(key);
+	if (found != s.index.end())
+	  return found->second->compiled;
+	if (s.lru.size() >= per_shard_){
+	  s.index.erase(s.lru.back().key);
+	  s.lru.pop_back();
+	  evictions_.fetch_add(1, std::memory_order_relaxed);
+	}
+	s.lru.push_front(entry{ key, compiled, ns });
+	s.index.emplace(std::move(key), s.lru.begin());
+	return compiled;
+      }
+
+      cache_stats stats() const
+      {
+	cache_stats st;
+	st.hits = hits_.load(std::memory_order_relaxed);
+	st.misses = misses_.load(std::memory_order_relaxed);
+	st.evictions = evictions_.load(std::memory_order_relaxed);
+	st.hit_rate = st.hits + st.misses ? 
+	  double(st.hits) / (st.hits + st.misses) : 0;
+	st.compile_time = std::chrono::nanoseconds(compile_ns_.load(std::memory_order_relaxed));
+	st.saved = std::chrono::nanoseconds(saved_ns_.load(std::memory_order_relaxed));
+	st.size = 0;
+	for (const shard & s : shards_){
+	  std::lock_guard<std::mutex> lock(s.mutex);
+	  st.size += s.lru.size();
+	}
+	return st;
+      }
+
+      // drops every program and zeroes the counters
+      void clear()
+      {
+	for (shard & s : shards_){
+	  std::lock_guard<std::mutex> lock(s.mutex);
+	  s.index.clear();
+	  s.lru.clear();
+	}
+	hits_ = 0;
+	misses_ = 0;
+	evictions_ = 0;
+	compile_ns_ = 0;
+	saved_ns_ = 0;
+      }
+
+      // the text with its spaces dropped, or made one where they 
+      // separate two names or numbers, two operator characters
+      // ("< =" is not "<="), or a number's exponent from its sign
+      // ("1e -5" and "1e- 5" are not "1e-5")
+      static std::string normalize(std::string_view text)
+      {
+	auto word = [](char c) { 
+	  return std::isalnum((unsigned char)c) || c == '_' || c == '.'; 
 	};
+	auto glued = [](char c) { 
+	  return c && std::strchr("<>=!&|", c); 
+	};
+	std::string key;
+	key.reserve(text.size());
+	bool space = false;
+	bool number = false;   // the last word began as a number
+	bool sign = false;     // the key ends with an exponent's sign
+	for (char c : text){
+	  if (std::isspace((unsigned char)c)){
+	    space = true;
+	    continue;
+	  }
+	  const char last = key.empty() ? 0 : key.back();
+	  const bool e = number && (last == 'e' || last == 'E');
+	  const bool pm = c == '+' || c == '-';
+	  if (space && last && 
+	      ((word(last) && word(c)) || (glued(last) && glued(c)) ||
+	       (e && pm) || (sign && word(c))))
+	    key += ' ';
+	  if (word(c)){
+	    if (space || !(word(last) || sign))
+	      number = std::isdigit((unsigned char)c) || c == '.';
+	  }
+	  else if (space || !(e && pm))
+	    number = false;
+	  sign = !space && e && pm;
+	  key += c;
+	  space = false;
+	}
+	return key;
       }
-    };
 
-  };     // end visitor
+    private:
+      struct entry{
 
+	std::string key;
+	program_ptr compiled;
+	std::uint64_t compile_ns;
+      };
 
-  namespace Interpreter{
+      struct shard{
 
-    // used to create grammars in C++
-    //
-    // I found this article, pretty inspiring
-    //
-    // http://www.peachpit.com/articles/article.aspx?p=467371
-    //
+	mutable std::mutex mutex;
+	std::list<entry> lru;              // most recently used first
+	std::unordered_map<std::string, std::list<entry>::iterator> index;
+      };
 
-    // http://www.peachpit.com/content/images/art_morris20_cinterpret/elementLinks/source.zip
+      std::vector<shard> shards_;
+      const std::size_t per_shard_;
+      std::atomic<std::uint64_t> hits_, misses_, evictions_;
+      std::atomic<std::uint64_t> compile_ns_, saved_ns_;
+    };
 
   };
 
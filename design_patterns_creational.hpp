@@ -4,6 +4,8 @@
 #include <iostream>
 #include <vector> 
 
+#include "design_patterns_log.hpp"
+
 namespace Creational_Patterns{
 
   namespace Abstract_Factory{
@@ -22,13 +24,13 @@ namespace Creational_Patterns{
     class OSX_Button : public Widget{
       
     public:
-      void draw() { std::cout << "\tOSX buttom" << std::endl; }
+      void draw() { PATTERN_LOG("\tOSX buttom"); }
     };
     
     class Windows_Button : public Widget{
       
     public:
-      void draw() { std::cout << "\tWindows buttom" << std::endl; }
+      void draw() { PATTERN_LOG("\tWindows buttom"); }
     };
   };  // end Abstract Factory
 
@@ -58,7 +60,7 @@ namespace Creational_Patterns{
     class SimpleBuilder : public Build { // a derived class
       
     public:
-      SimpleBuilder() { std::cout << "\tSimple Builder" << std::endl;};
+      SimpleBuilder() { PATTERN_LOG("\tSimple Builder");};
       void configure() 
       { /// 
       };
@@ -67,7 +69,7 @@ namespace Creational_Patterns{
     class AdvancedBuilder : public Build { // a derived class
       
     public:
-      AdvancedBuilder() { std::cout << "\tAdvanced Builder" << std::endl;};
+      AdvancedBuilder() { PATTERN_LOG("\tAdvanced Builder");};
       void configure() 
       { /// 
       };
@@ -115,14 +117,14 @@ namespace Creational_Patterns{
     
     class A : public Base{
     public:
-      A() { std::cout << "\tClass A"<< std::endl;}
+      A() { PATTERN_LOG("\tClass A");}
       void what_to_do() { };
 
     };
 
     class B : public Base{
     public:
-      B() { std::cout << "\tClass B"<< std::endl;}
+      B() { PATTERN_LOG("\tClass B");}
       void what_to_do() { };
 
     };
@@ -143,7 +145,7 @@ namespace Creational_Patterns{
     class Object_to_share{
       
     public:
-      Object_to_share(){ std::cout << "\tAn object to share" <<std::endl;};
+      Object_to_share(){ PATTERN_LOG("\tAn object to share");};
 
     };
 
@@ -151,7 +153,7 @@ namespace Creational_Patterns{
 
     public:
       Object_to_share * getObject(void)
-      { std::cout<< "\tGetting object" <<std::endl; 
+      { PATTERN_LOG("\tGetting object"); 
 	return &(objpool_[0]);    // whatever policy you need to adopt
       }
 
@@ -196,8 +198,8 @@ namespace Creational_Patterns{
 
       static void add_a_proto(Proto * proto)
       { prototypes_[next_slot_++] = proto;
-	// std::cout << "\tRegistering prototype " << proto->returnType()
-	// << " next slot is " << next_slot_ << std::endl;
+	// PATTERN_LOG("\tRegistering prototype " << proto->returnType()
+	// << " next slot is " << next_slot_);
       };
 	
     private:
@@ -261,7 +263,7 @@ namespace Creational_Patterns{
       };
       
     protected:
-      Single(){ std::cout << "\tSingle" << std::endl;};// cannot be invoked
+      Single(){ PATTERN_LOG("\tSingle");};// cannot be invoked
       
     private:
       static Single * instance_;  // a single instance
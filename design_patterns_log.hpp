@@ -0,0 +1,327 @@
+#ifndef DESIGN_PATTERNS_LOG_
+#define DESIGN_PATTERNS_LOG_
+
+// What the pattern classes have to say goes through the log:
+//
+//   PATTERN_LOG("\tcreated an icon with name=" << name);   // a line
+//   PATTERN_LOG_PART("on is the state");                   // no '\n'
+//
+// Built with -DDESIGN_PATTERNS_NO_LOG both compile to nothing, their
+// arguments are not even evaluated.  Otherwise a line is formatted
+// by the calling thread in a buffer of its own.  In ASYNC mode, the
+// default, a writer thread drains every buffer to the output and
+// flushes it once per round; lines of one thread keep their order,
+// but lines of different threads only keep theirs across a flush():
+// one thread's line may come out after a later line of another.
+// In SYNC mode the caller writes and flushes each line itself, as
+// std::endl did, so lines come out in the order they were made.
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace Logging{
+
+  enum class mode { SYNC, ASYNC };
+
+#if defined(DESIGN_PATTERNS_NO_LOG)
+
+// the arguments are only looked at by sizeof, never run, yet what
+// they name counts as used
+#define PATTERN_LOG(...) ((void)sizeof(::Logging::line() << __VA_ARGS__))
+#define PATTERN_LOG_PART(...) ((void)sizeof(::Logging::line() << __VA_ARGS__))
+
+  // kept, so that callers build either way
+
+  class line{
+
+  public:
+    template <typename T>
+    line & operator<<(const T &) { return *this; }
+  };
+
+  inline void set_mode(mode) {}
+  inline std::ostream & set_output(std::ostream & os) { return os; }
+  inline void flush() {}
+
+#else
+
+#define PATTERN_LOG(...) \
+  do { ::Logging::line log_line_; log_line_ << __VA_ARGS__ << '\n'; } while (0)
+#define PATTERN_LOG_PART(...) \
+  do { ::Logging::line log_line_; log_line_ << __VA_ARGS__; } while (0)
+
+  class sink{
+
+  public:
+    static sink & instance()
+    {
+      static sink s;
+      return s;
+    }
+
+    // the text of one thread, waiting for the writer
+    struct buffer{
+
+      buffer() : done(false) {};
+      std::mutex mutex;
+      std::string text;
+      bool done;           // its thread has exited
+    };
+
+    void commit(std::string_view text)
+    {
+      if (mode_ == mode::SYNC){
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	out_->write(text.data(), text.size());
+	out_->flush();
+      }
+      else{
+	buffer & b = local();
+	std::size_t size;
+	{
+	  std::lock_guard<std::mutex> lock(b.mutex);
+	  b.text += text;
+	  size = b.text.size();
+	}
+	if (size >= wake_size_ && size - text.size() < wake_size_)
+	  wake();
+      }
+    }
+
+    void set_mode(mode m)
+    {
+      flush();
+      mode_ = m;
+    }
+
+    std::ostream & set_output(std::ostream & os)
+    {
+      flush();
+      std::lock_guard<std::mutex> lock(out_mutex_);
+      std::ostream * previous = out_;
+      out_ = &os;
+      return *previous;
+    }
+
+    // returns once every line committed so far is written
+    void flush()
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      const std::uint64_t target = ++flush_wanted_;
+      wake_.notify_one();
+      flushed_cv_.wait(lock, [&] { return flushed_ >= target; });
+    }
+
+    ~sink()
+    {
+      {
+	std::lock_guard<std::mutex> lock(mutex_);
+	stop_ = true;
+      }
+      wake_.notify_one();
+      writer_.join();
+    }
+
+  private:
+    sink() : mode_(mode::ASYNC), out_(&std::cout), flush_wanted_(0),
+	     flushed_(0), woken_(false), stop_(false)
+    {
+      writer_ = std::thread([this] { run(); });
+    }
+
+    static constexpr std::size_t wake_size_ = 64 * 1024;
+
+    // registers a buffer for the calling thread on its first line
+    buffer & local()
+    {
+      struct holder{
+
+	holder() : b(std::make_shared<buffer>())
+	{
+	  sink & s = instance();
+	  std::lock_guard<std::mutex> lock(s.buffers_mutex_);
+	  s.buffers_.push_back(b);
+	}
+	~holder()
+	{
+	  std::lock_guard<std::mutex> lock(b->mutex);
+	  b->done = true;
+	}
+	std::shared_ptr<buffer> b;
+      };
+      thread_local holder h;
+      return *h.b;
+    }
+
+    void wake()
+    {
+      {
+	std::lock_guard<std::mutex> lock(mutex_);
+	woken_ = true;
+      }
+      wake_.notify_one();
+    }
+
+    void run()
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;){
+	wake_.wait_for(lock, std::chrono::milliseconds(10), [this]
+		       { return stop_ || woken_ || flush_wanted_ != flushed_; });
+	woken_ = false;
+	const std::uint64_t target = flush_wanted_;
+	const bool stopping = stop_;
+	lock.unlock();
+	drain();
+	lock.lock();
+	flushed_ = target;
+	flushed_cv_.notify_all();
+	if (stopping)
+	  return;
+      }
+    }
+
+    // one round: every buffer written out, then a single flush
+    void drain()
+    {
+      std::vector<std::shared_ptr<buffer> > buffers;
+      {
+	std::lock_guard<std::mutex> lock(buffers_mutex_);
+	buffers = buffers_;
+      }
+      bool any = false, finished = false;
+      for (std::size_t i = 0; i < buffers.size(); ++i){
+	{
+	  std::lock_guard<std::mutex> lock(buffers[i]->mutex);
+	  spare_.swap(buffers[i]->text);
+	  finished = finished || buffers[i]->done;
+	}
+	if (spare_.empty())
+	  continue;
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	out_->write(spare_.data(), spare_.size());
+	spare_.clear();
+	any = true;
+      }
+      if (any){
+	std::lock_guard<std::mutex> lock(out_mutex_);
+	out_->flush();
+      }
+      if (finished){
+	std::lock_guard<std::mutex> lock(buffers_mutex_);
+	std::erase_if(buffers_, [](const std::shared_ptr<buffer> & b){
+	    std::lock_guard<std::mutex> lock(b->mutex);
+	    return b->done && b->text.empty(); });
+      }
+    }
+
+    std::atomic<mode> mode_;
+
+    std::mutex out_mutex_;
+    std::ostream * out_;
+
+    std::mutex buffers_mutex_;
+    std::vector<std::shared_ptr<buffer> > buffers_;
+    std::string spare_;                   // the writer's
+
+    std::mutex mutex_;
+    std::condition_variable wake_, flushed_cv_;
+    std::uint64_t flush_wanted_, flushed_;
+    bool woken_, stop_;
+    std::thread writer_;
+  };
+
+  // a line being formatted, committed to the sink when destroyed,
+  // unless an exception left it unfinished; numbers and characters
+  // are printed as std::cout prints them by default.  A line 
+  // formatted while another is (a function logging from inside the
+  // arguments) is committed on its own, ahead of it
+
+  class line{
+
+  public:
+    line() : text_(pending()), from_(text_.size()), 
+	     exceptions_(std::uncaught_exceptions()) {};
+    ~line() 
+    { 
+      if (std::uncaught_exceptions() == exceptions_)
+	sink::instance().commit(std::string_view(text_).substr(from_)); 
+      text_.resize(from_);
+    }
+
+    line(const line &) = delete;
+    line & operator=(const line &) = delete;
+
+    line & operator<<(const char * s) { text_ += s; return *this; }
+    line & operator<<(std::string_view s) { text_ += s; return *this; }
+    line & operator<<(const std::string & s) { text_ += s; return *this; }
+    line & operator<<(char c) { text_ += c; return *this; }
+    line & operator<<(signed char c) { text_ += char(c); return *this; }
+    line & operator<<(unsigned char c) { text_ += char(c); return *this; }
+    line & operator<<(bool b) { text_ += b ? '1' : '0'; return *this; }
+
+    // as for std::ostream
+    line & operator<<(wchar_t) = delete;
+    line & operator<<(char8_t) = delete;
+    line & operator<<(char16_t) = delete;
+    line & operator<<(char32_t) = delete;
+
+    template <typename T>
+    requires std::is_arithmetic_v<T>
+    line & operator<<(T value)
+    {
+      // sign, digits, and for floats the point and the exponent
+      char digits[std::numeric_limits<T>::digits10 + 16];
+      std::to_chars_result r;
+      if constexpr (std::is_floating_point_v<T>)
+	r = std::to_chars(digits, digits + sizeof(digits), value,
+			  std::chars_format::general, 6);
+      else
+	r = std::to_chars(digits, digits + sizeof(digits), value);
+      if (r.ec == std::errc())
+	text_.append(digits, r.ptr);
+      return *this;
+    }
+
+  private:
+    // reused by every line of the thread, no allocation once grown
+    static std::string & pending()
+    {
+      thread_local std::string text;
+      return text;
+    }
+
+    std::string & text_;
+    const std::size_t from_;
+    const int exceptions_;
+  };
+
+  inline void set_mode(mode m) { sink::instance().set_mode(m); }
+
+  // where the lines go, std::cout unless told otherwise; returns the
+  // previous output
+  inline std::ostream & set_output(std::ostream & os)
+  {
+    return sink::instance().set_output(os);
+  }
+
+  inline void flush() { sink::instance().flush(); }
+
+#endif
+
+};
+
+#endif
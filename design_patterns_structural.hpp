@@ -3,6 +3,8 @@
 
 #include <vector>
 
+#include "design_patterns_log.hpp"
+
 namespace Structural_Patterns{
 
   namespace Adapter{
@@ -20,7 +22,7 @@ namespace Structural_Patterns{
     class LegacyInterface{
       
     public:
-      LegacyInterface() { std::cout << "\tCalled legacy" << std::endl;};
+      LegacyInterface() { PATTERN_LOG("\tCalled legacy");};
     };
 
     // privately inherits the implementation of the legacy component
@@ -29,7 +31,7 @@ namespace Structural_Patterns{
 
     public:
       adapter() : LegacyInterface(){};
-      void make () { std::cout << "\tAdapter do something " << std::endl;}
+      void make () { PATTERN_LOG("\tAdapter do something ");}
     };
     
   }; //end adapter
@@ -69,7 +71,7 @@ namespace Structural_Patterns{
     class a : public bridge{ // hierarchy
 
     public:
-      a(){ imp_ = new a_imp_(); std::cout << "\tcreated a" << std::endl;};
+      a(){ imp_ = new a_imp_(); PATTERN_LOG("\tcreated a");};
     };
 
     class b_imp_ : public bridge_imp_{ // implementation hierarchy
@@ -81,7 +83,7 @@ namespace Structural_Patterns{
     class b : public bridge{ // hierarchy
 
     public:
-      b() { imp_ = new b_imp_(); std::cout << "\tcreated b" << std::endl;};
+      b() { imp_ = new b_imp_(); PATTERN_LOG("\tcreated b");};
     };
 
   };  // end Bridge
@@ -105,7 +107,7 @@ namespace Structural_Patterns{
 
     public:
       Leaf(int val) : value_(val) {};
-      void traverse() { std::cout << value_ << " "; }
+      void traverse() { PATTERN_LOG_PART(value_ << " "); }
     };
 
     class Composite : public Component{
@@ -139,9 +141,9 @@ namespace Structural_Patterns{
     class A{
       
     public:
-      A() { std::cout << "\tA" << std::endl; }
+      A() { PATTERN_LOG("\tA"); }
 
-      virtual void make(void) { std::cout << "\t making A" << std::endl; }
+      virtual void make(void) { PATTERN_LOG("\t making A"); }
     };
 
     //
@@ -153,7 +155,7 @@ namespace Structural_Patterns{
       void make(void) { A::make(); make_x(); };
 
     private:
-      void make_x() { std::cout << "\t making X" << std::endl; };
+      void make_x() { PATTERN_LOG("\t making X"); };
     };
 
   }; // end Decorator
@@ -167,22 +169,22 @@ namespace Structural_Patterns{
     class A{
       
     public:
-      A() { std::cout << "\tInit A" << std::endl; }
-      void make() { std::cout << "\tmake A" << std::endl; }
+      A() { PATTERN_LOG("\tInit A"); }
+      void make() { PATTERN_LOG("\tmake A"); }
     };
 
     class B{
 
     public:
-      B() { std::cout << "\tInit B" << std::endl; }   
-      void make() { std::cout << "\tmake B" << std::endl; }   
+      B() { PATTERN_LOG("\tInit B"); }   
+      void make() { PATTERN_LOG("\tmake B"); }   
     };
 
     class C{
 
     public:
-      C() { std::cout << "\tInit C" << std::endl; }
-      void make() { std::cout << "\tmake C" << std::endl; }
+      C() { PATTERN_LOG("\tInit C"); }
+      void make() { PATTERN_LOG("\tmake C"); }
     };
 
     class facade{
@@ -235,13 +237,13 @@ namespace Structural_Patterns{
 	it_end = icons_.end();
 	for (; it != it_end; ++it){
 	  if ((*it)->getName() == name){
-	    std::cout << "\tFlyweight -> reusing an icon with name=" 
-		      << name << std::endl;
+	    PATTERN_LOG("\tFlyweight -> reusing an icon with name=" 
+			<< name);
 	    return *it;
 	  }
 	}
 	icons_.push_back(new Icon(name));
-	std::cout << "\tCreated a new icon with name=" << name << std::endl;
+	PATTERN_LOG("\tCreated a new icon with name=" << name);
 	return icons_.back();
       }; // an example: get an Icon allocated
 
@@ -270,13 +272,13 @@ namespace Structural_Patterns{
 
     public:
       ImageProxy(unsigned int name) : name_(name) 
-      { std::cout << "\tCreating image name=" << name_ << std::endl; };
+      { PATTERN_LOG("\tCreating image name=" << name_); };
 
       ~ImageProxy() 
-      { std::cout << "\tDelete image name=" << name_ << std::endl; };
+      { PATTERN_LOG("\tDelete image name=" << name_); };
       
       void draw() 
-      { std::cout << "\tDraw image name=" << name_ << std::endl; };
+      { PATTERN_LOG("\tDraw image name=" << name_); };
     };
 
     class Image{
@@ -1,13 +1,17 @@
 #include "design_patterns_creational.hpp"
 #include "design_patterns_structural.hpp"
 #include "design_patterns_behavioural.hpp"
+
+#include <filesystem>
+#include <numeric>
+#include <sstream>
   
 void creational(void) {
 
   {
     using namespace Creational_Patterns::Abstract_Factory;
     
-    std::cout << "Example of Abstract Factory" << std::endl;
+    PATTERN_LOG("Example of Abstract Factory");
 
     Widget * w1 = new OSX_Button;
     Widget * w2 = new Windows_Button;
@@ -19,7 +23,7 @@ void creational(void) {
   {
     using namespace Creational_Patterns::Builder;
     
-    std::cout << "Example of Builder" << std::endl;
+    PATTERN_LOG("Example of Builder");
 
     Build * b = new SimpleBuilder();
     ClientClass * c = new ClientClass(b);
@@ -32,7 +36,7 @@ void creational(void) {
     
     std::vector<Base *> factory;
 
-    std::cout << "Example of Factory" << std::endl;
+    PATTERN_LOG("Example of Factory");
 
     // here you can have multiple choices deferred to this level
 
@@ -43,7 +47,7 @@ void creational(void) {
   {
     using namespace Creational_Patterns::Object_Pool;
     
-    std::cout << "Example of Object Pool" << std::endl;
+    PATTERN_LOG("Example of Object Pool");
 
     Pool pool;
     pool.getObject();
@@ -52,24 +56,24 @@ void creational(void) {
   {
     using namespace Creational_Patterns::Prototype;
    
-    std::cout << "Example of Proto" << std::endl;
+    PATTERN_LOG("Example of Proto");
 
     Proto * collection[num_protos_];
  
     collection[0] = Proto::findAClone(type_a);
-    std::cout << "\t type_a found the expected type=" << 
-      (collection[0]->returnType()==type_a ? "yes" : "no" ) << std::endl;
+    PATTERN_LOG("\t type_a found the expected type=" << 
+      (collection[0]->returnType()==type_a ? "yes" : "no" ));
 
     collection[1] = Proto::findAClone(type_b);
-    std::cout << "\t type_b found the expected type=" << 
-      (collection[0]->returnType()==type_b ? "yes" : "no" ) << std::endl;
+    PATTERN_LOG("\t type_b found the expected type=" << 
+      (collection[0]->returnType()==type_b ? "yes" : "no" ));
   
   }
 
   {
     using namespace Creational_Patterns::Singleton;
    
-    std::cout << "Example of Singleton" << std::endl;
+    PATTERN_LOG("Example of Singleton");
 
     for (unsigned int i = 0 ; i < 100 ; ++i)
       Single::getInstance();
@@ -82,7 +86,7 @@ void structural(void){
  {
     using namespace Structural_Patterns::Adapter;
    
-    std::cout << "Example of Adapter" << std::endl;
+    PATTERN_LOG("Example of Adapter");
 
     adapter * ada = new adapter();
     ada->make();
@@ -91,7 +95,7 @@ void structural(void){
  {
     using namespace Structural_Patterns::Bridge;
    
-    std::cout << "Example of Bridge" << std::endl;
+    PATTERN_LOG("Example of Bridge");
 
     bridge * b1 = new a();
     bridge * b2 = new b();
@@ -100,7 +104,7 @@ void structural(void){
  {
     using namespace Structural_Patterns::Composite;
    
-    std::cout << "Example of Composite" << std::endl;
+    PATTERN_LOG("Example of Composite");
 
     Composite containers[10];
 
@@ -111,15 +115,15 @@ void structural(void){
       containers[0].add(&(containers[i]));
     }
     
-    std::cout << "\t";
+    PATTERN_LOG_PART("\t");
     containers[0].traverse();
-    std::cout << std::endl;
+    PATTERN_LOG("");
  }
 
  {
    using namespace Structural_Patterns::Decorator;
 
-   std::cout << "Example of Decorator" << std::endl;
+   PATTERN_LOG("Example of Decorator");
 
    A_and_X ax;
    ax.make();
@@ -128,14 +132,14 @@ void structural(void){
  {
    using namespace Structural_Patterns::Facade;
 
-   std::cout << "Example of Facade" << std::endl;
+   PATTERN_LOG("Example of Facade");
    facade f;
  }
 
  {
    using namespace Structural_Patterns::Flyweight;
 
-   std::cout << "Example of Flyweight" << std::endl;
+   PATTERN_LOG("Example of Flyweight");
 
    Icon * i0 = FlyweightFactory::getIcon(0);
    Icon * i1 = FlyweightFactory::getIcon(1);
@@ -147,7 +151,7 @@ void structural(void){
 
  {
    using namespace Structural_Patterns::Proxy;
-   std::cout << "Example of Proxy" << std::endl;
+   PATTERN_LOG("Example of Proxy");
 
    Image image[10];
 
@@ -165,7 +169,7 @@ void behavioural(){
   {
     using  namespace Behavioural_Patterns::Chain_Of_Responsability;
     
-    std::cout << "Example of Chain of Responsability" << std::endl;
+    PATTERN_LOG("Example of Chain of Responsability");
 
     H1 root(1);
     H1 h1(2);
@@ -175,10 +179,49 @@ void behavioural(){
     root.handle(3);
   }
 
+  {
+    using  namespace Behavioural_Patterns::Chain_Of_Responsability;
+    
+    PATTERN_LOG("Example of static Chain of Responsability");
+
+    StaticChain<H1, H2> chain(H1(1), H2(2));
+    H1 h3(3);
+    chain.add(&h3);     // dynamic fallback
+    chain.handle(2);
+    chain.handle(3);
+
+    unsigned int requests[] = { 2, 1, 3 };
+    chain.handle_batch(requests);
+    PATTERN_LOG("\tH1 handled " << chain.handler<0>().handled() 
+		<< " passed " << chain.handler<0>().passed()
+		<< ", H2 handled " << chain.handler<1>().handled() 
+		<< " passed " << chain.handler<1>().passed());
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Chain_Of_Responsability;
+    
+    PATTERN_LOG("Example of batched Chain of Responsability");
+
+    H1 root(1);
+    H1 h1(2);
+    H2 h2(3);
+    root.add(&h1);
+    root.add(&h2);
+
+    unsigned int requests[] = { 3, 1, 2, 7, 3 };
+    std::size_t left = root.handle_batch(requests);
+
+    PATTERN_LOG("\tunhandled " << left);
+    for (Base * b : { (Base *)&root, (Base *)&h2, (Base *)&h1 })
+      PATTERN_LOG("\thandled " << b->handled() 
+		  << " passed " << b->passed());
+  }
+
   {
     using  namespace Behavioural_Patterns::Command;
     
-    std::cout << "Example of Command" << std::endl;
+    PATTERN_LOG("Example of Command");
 
     client c; 
     command * com =        // registerig the specific command
@@ -186,10 +229,95 @@ void behavioural(){
     com->execute(3);
   }
 
+  {
+    using  namespace Behavioural_Patterns::Command;
+    
+    PATTERN_LOG("Example of Command queue");
+
+    client c;
+    a_specific_command com(&c, &client::client_function);
+    command_queue<> queue;
+
+    std::thread producers[2];
+    for (int p = 0; p < 2; ++p)  // commands from many threads
+      producers[p] = std::thread([&, p] { queue.push(com, 10 + p); });
+    for (int p = 0; p < 2; ++p)
+      producers[p].join();
+    struct failing : public command{
+      void execute(int) { throw std::runtime_error("failed"); }
+    };
+    queue.push(failing(), 0);    // does not take the executor down
+    queue.stop();
+
+    PATTERN_LOG("\texecuted " << queue.executed() 
+		<< " failed " << queue.failed()
+		<< " depth " << queue.depth());
+    PATTERN_LOG("\tpush after stop accepted=" << queue.push(com, 12));
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Command;
+    
+    PATTERN_LOG("Example of Command journal");
+
+    const std::string journal_path = 
+      (std::filesystem::temp_directory_path() / "command.journal").string();
+    const char * path = journal_path.c_str();
+    client c;
+    a_specific_command com(&c, &client::client_function);
+    {
+      command_journal<> journal(path);
+      journal.add_receiver(&c);
+      journal.add_action(&client::client_function);
+      com.record(journal, 5);   // durable on commit
+      com.record(journal, 6);
+    }
+
+    client restarted;          // replay after a restart
+    command_journal<> journal(path);
+    journal.add_receiver(&restarted);
+    journal.add_action(&client::client_function);
+    journal.replay();
+
+    command_journal<> fewer(path);   // registered differently
+    fewer.add_receiver(&restarted);
+    try{
+      fewer.replay();
+    }
+    catch (const std::out_of_range &){
+      PATTERN_LOG("\treplay without the action rejected");
+    }
+    std::remove(path);
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Command;
+    
+    PATTERN_LOG("Example of Command by value");
+
+    client c;
+    std::vector<small_command<> > commands;  // no new per command
+    commands.push_back(small_command<>(&c, &client::client_function));
+    commands.push_back([&c](int what) { c.client_function(what * 2); });
+    std::unique_ptr<int> offset(new int(100));   // move-only state
+    commands.push_back([&c, o = std::move(offset)](int what) 
+		       { c.client_function(what + *o); });
+
+    for (std::size_t i = 0; i < commands.size(); ++i)
+      commands[i].execute(7);
+
+    try{
+      small_command<> copy(commands.back());
+    }
+    catch (const std::logic_error &){
+      PATTERN_LOG("\tthe move-only command is not copied");
+    }
+  }
+
   {
     using  namespace Behavioural_Patterns::Iterator;
 
-    std::cout << "Example of Iterator" << std::endl;
+    PATTERN_LOG("Example of Iterator");
 
     stack s;
 
@@ -200,20 +328,83 @@ void behavioural(){
     iterator it(s);
     
     for (int i = 0; it() ; ++i, ++it)
-      { std::cout << "\ti=" << i << " " 
-		  << *it << " " << std::endl; }
+      { PATTERN_LOG("\ti=" << i << " " 
+		    << *it << " "); }
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Iterator;
+
+    PATTERN_LOG("Example of Iterator bulk operations");
+
+    int values[] = { 1, 2, 3, 4, 5 };
+    stack s1, s2;
+
+    s1.reserve(1000);     // no fixed capacity any more
+    s1.push_range(values);
+    s2.push_range(values);
+    s2.pop_n(2);
+
+    PATTERN_LOG("\tsizes " << s1.size() << " " << s2.size() 
+		<< " equal=" << (s1 == s2 ? "yes" : "no"));
+    s1.pop_n(2);
+    PATTERN_LOG("\tafter pop_n equal=" 
+		<< (s1 == s2 ? "yes" : "no"));
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Iterator;
+
+    PATTERN_LOG("Example of Iterator with standard algorithms");
+
+    stack s;
+    for (int i = 9; i > 0; i -= 2)
+      s.push(i);
+
+    std::sort(s.begin(), s.end());
+    {
+      Logging::line sorted;
+      sorted << "\tsorted";
+      for (int v : s)
+	sorted << " " << v;
+      sorted << '\n';
+    }
+    PATTERN_LOG("\tsum " << std::accumulate(s.begin(), s.end(), 0));
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Iterator;
+
+    PATTERN_LOG("Example of Iterator pipelines");
+
+    stack s;
+    for (int i = 1; i < 10; i++)
+      s.push(i);
+
+    // nothing runs until the reduce, then in a single pass
+    auto odd_squares = pipe(s) 
+      | filter([](int v) { return v % 2; }) 
+      | map([](int v) { return v * v; });
+
+    PATTERN_LOG("\tsum of odd squares " << (odd_squares | reduce(0))
+		<< ", chunked " << (odd_squares.chunked(4) | reduce(0)));
+
+    Logging::line blocks;       // whole blocks to a kernel of our own
+    blocks << "\tblocks of";
+    odd_squares.chunked(4) | for_each_block([&blocks](const int *, std::size_t n)
+					     { blocks << " " << n; });
+    blocks << '\n';
   }
 
   {
     using  namespace Behavioural_Patterns::Mediator;
 
-    std::cout << "Example of Mediator" << std::endl;
+    PATTERN_LOG("Example of Mediator");
 
     list l;
     node a(1), b(2), c(3), d(4);
 
-    std::cout << "\tList mediates between nodes" 
-	      << std::endl << "\t";
+    PATTERN_LOG_PART("\tList mediates between nodes\n\t");
 
     l.add(&a);
     l.add(&b);
@@ -222,24 +413,101 @@ void behavioural(){
     l.traverse();
   }
 
+  {
+    using  namespace Behavioural_Patterns::Mediator;
+
+    PATTERN_LOG("Example of Mediator owning its nodes");
+
+    node_list l;
+    node_list::index first = l.add(1);
+    for (int v = 2; v < 5; ++v)
+      l.add(v);
+
+    PATTERN_LOG_PART("\tList mediates between nodes, first is " 
+		     << l[first].getValue() << "\n\t");
+    l.traverse();
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Mediator;
+
+    PATTERN_LOG("Example of Mediator message bus");
+
+    message_bus<int> bus(3);    // three colleagues: 0, 1 and 2
+
+    bus.send(0, 1, [](int & m) { m = 42; });   // written in place
+    bus.broadcast(2, [](int & m) { m = 7; });  // one shared slot
+
+    for (message_bus<int>::colleague c = 0; c < 3; ++c)
+      bus.receive(c, [c](message_bus<int>::colleague from, const int & m)
+		  { PATTERN_LOG("\t" << c << " got " << m 
+				<< " from " << from); });
+
+    message_bus<int>::channel_stats st = bus.stats(2, 1);
+    PATTERN_LOG("\tchannel 2->1 sent " << st.sent << " dropped " 
+		<< st.dropped << " depth " << st.depth);
+  }
+
   { 
     using  namespace Behavioural_Patterns::Memento;
 
-    std::cout << "Example of Memento" << std::endl;    
+    PATTERN_LOG("Example of Memento");    
 
     client c(10);
     memento * m = c.create_memento();
     c.increment();
     c.restore_from_memento(m);  // undo
     
-    std::cout << "\t incrementing 10 and restoring from memento c=" <<
-      c.get_value() << std::endl;
+    PATTERN_LOG("\t incrementing 10 and restoring from memento c=" <<
+      c.get_value());
+  }
+
+  { 
+    using  namespace Behavioural_Patterns::Memento;
+
+    PATTERN_LOG("Example of Memento history");    
+
+    client c(10);
+    memento_history<client> history(1024);  // bytes of history at most
+
+    memento_history<client>::id first = history.save(c);
+    for (int i = 0; i < 5; ++i){
+      c.increment();
+      history.save(c);
+    }
+    history.restore(first + 2, c);   // undo three steps
+    
+    PATTERN_LOG("\t incrementing 10 five times and restoring c=" <<
+      c.get_value() << " from " << history.size() << " snapshots");
+  }
+
+  { 
+    using  namespace Behavioural_Patterns::Memento;
+
+    PATTERN_LOG("Example of Memento checkpoint");    
+
+    const std::string checkpoint_path = 
+      (std::filesystem::temp_directory_path() / "memento.checkpoint").string();
+    const char * path = checkpoint_path.c_str();
+    {
+      client c(10);
+      memento_checkpoint<client> file(path);
+      c.increment();
+      file.checkpoint(c);     // only the changed pages are written
+    }
+
+    memento_checkpoint<client> file(path);   // after a restart
+    client c(0);
+    file.restore(c);
+    PATTERN_LOG("\t restored from checkpoint c=" << c.get_value() 
+		<< " generation " << file.generation());
+    std::remove(path);
   }
 
   { 
     using  namespace Behavioural_Patterns::Observer;
 
-    std::cout << "Example of Observer" << std::endl;    
+    PATTERN_LOG("Example of Observer");    
     
     a_observer a_o;
     b_observer b_o;
@@ -251,34 +519,123 @@ void behavioural(){
 
     s.set_value(10);
 
+    s.detach(&a_o);     // safe even while another thread notifies
+    s.set_value(11);
+  }
+
+  { 
+    using  namespace Behavioural_Patterns::Observer;
+
+    PATTERN_LOG("Example of asynchronous Observer");    
+    
+    a_observer a_o;
+    b_observer b_o;
+    
+    subject s;
+
+    s.attach(&a_o);
+    async_observer & b_async = s.attach_async(&b_o, 1);
+
+    s.set_value(10);   // b does not hold up the setter
+    s.flush();
+    
+    PATTERN_LOG("\tb lag " << b_async.lag() << " delivered " 
+		<< b_async.delivered() << " merged " << b_async.merged());
+
+    struct counting : public observer{
+      std::atomic<int> seen{0};
+      void update(int) { ++seen; }
+    };
+    subject busy;
+    counting * c = new counting;
+    busy.attach_async(c);
+    for (int i = 0; i < 1000; ++i)
+      busy.set_value(i);
+    busy.detach(c);    // its thread is stopped: c can go
+    const int seen = c->seen;
+    busy.set_value(12);
+    PATTERN_LOG("\tupdated after detach " << (c->seen != seen ? "yes" : "no"));
+    delete c;
+    busy.set_value(13);
+  }
+
+  { 
+    using  namespace Behavioural_Patterns::Observer;
+
+    PATTERN_LOG("Example of Observer with topics");    
+    
+    a_observer a_o;
+    b_observer b_o;
+    
+    subject s;
+    const topic price = 1, volume = 2;
+
+    s.attach(&a_o, price);   // a only cares about the price
+    s.attach(&b_o);
+
+    s.set_value(price, 10);
+    s.set_value(volume, 20);
   }
 
   { 
     using  namespace Behavioural_Patterns::State;
     
-    std::cout << "Example of State" << std::endl;    
+    PATTERN_LOG("Example of State");    
 
     tool t;
 
     OFF * off_state = new OFF();
     ON * on_state = new ON();
 
-    std::cout << "\tcreating on state" << std::endl;
+    PATTERN_LOG("\tcreating on state");
 
     t.set_current(on_state);
     on_state->off(&t);
 
-    std::cout << "\tcreating off state" << std::endl;
+    PATTERN_LOG("\tcreating off state");
 
     t.set_current(off_state);
     off_state->on(&t);    
 
   }
+
+  { 
+    using  namespace Behavioural_Patterns::State;
+    
+    PATTERN_LOG("Example of table driven State");    
+
+    switch_counts counts;
+    switch_machine m(counts, power::ON);
+
+    m.fire(press::OFF);
+    m.fire(press::OFF);   // no transition, stays OFF
+    m.fire(press::ON);
+
+    PATTERN_LOG("\tis " << (m.current() == power::ON ? "ON" : "OFF") 
+		<< " after " << counts.off << " off and " << counts.on 
+		<< " on transitions");
+  }
+
+  { 
+    using  namespace Behavioural_Patterns::State;
+    
+    PATTERN_LOG("Example of many State machines at once");    
+
+    switch_machines many(5, power::OFF);
+    press events[] = { press::ON, press::OFF, press::ON, press::ON, press::OFF };
+
+    many.fire(events);   // events[i] goes to machine i
+    Logging::line states;
+    states << "\t";
+    for (std::size_t i = 0; i < many.size(); ++i)
+      states << (many.state(i) == power::ON ? " ON" : " OFF");
+    states << '\n';
+  }
     
   {
     using  namespace Behavioural_Patterns::Strategy;
 
-    std::cout << "Example of Strategy" << std::endl;    
+    PATTERN_LOG("Example of Strategy");    
     
     testbed ts;
     
@@ -286,25 +643,92 @@ void behavioural(){
     ts.choose_strategy(ALGO2);
   }
 
+  {
+    using  namespace Behavioural_Patterns::Strategy;
+
+    PATTERN_LOG("Example of adaptive Strategy");    
+
+    adaptive_strategy<std::vector<int> > sorter;
+    sorter.add("insertion sort", [](std::vector<int> & v){
+	for (std::size_t i = 1; i < v.size(); ++i)
+	  for (std::size_t j = i; j && v[j - 1] > v[j]; --j)
+	    std::swap(v[j - 1], v[j]);
+      });
+    sorter.add("std::sort", [](std::vector<int> & v)
+	       { std::sort(v.begin(), v.end()); });
+
+    bool sorted = true;
+    for (int round = 0; round < 50; ++round)
+      for (std::size_t size : { 8, 2000 }){
+	std::vector<int> v(size);
+	for (std::size_t i = 0; i < size; ++i)
+	  v[i] = (i * 7919) % size;
+	sorter.run(v, size);
+	sorted = sorted && std::is_sorted(v.begin(), v.end());
+      }
+
+    // which one wins depends on the machine, not printed
+    for (const auto & d : sorter.decisions())
+      PATTERN_LOG("\tsizes below " << (1ul << d.bucket) << ": every "
+		  << "candidate ran " << (std::ranges::min(d.calls) > 0 ? 
+					  "yes" : "no"));
+    PATTERN_LOG("\tall sorted " << (sorted ? "yes" : "no"));
+
+    adaptive_strategy<std::vector<int> > none;
+    std::vector<int> v;
+    try{
+      none.run(v, 0);
+    }
+    catch (const std::logic_error &){
+      PATTERN_LOG("\tno candidate rejected");
+    }
+    try{
+      adaptive_strategy<std::vector<int> > never(8, 0);
+    }
+    catch (const std::invalid_argument &){
+      PATTERN_LOG("\tzero exploration period rejected");
+    }
+  }
+
   {
     using  namespace Behavioural_Patterns::Template;
 
-    std::cout << "Example of Template" << std::endl;    
+    PATTERN_LOG("Example of Template");    
     
     algorithm_refinement_first_model a1;
     algorithm_refinement_second_model a2;
 
-    std::cout << "Executing algorithm 1" << std::endl;
+    PATTERN_LOG("Executing algorithm 1");
+    a1.execute();
+
+    PATTERN_LOG("Executing algorithm 2");
+    a2.execute();
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Template;
+
+    PATTERN_LOG("Example of compile time Template");    
+    
+    static_refinement_first_model<> a1;            // no timing, no cost
+    static_refinement_second_model<step_timing> a2;
+
+    PATTERN_LOG("Executing algorithm 1");
     a1.execute();
 
-    std::cout << "Executing algorithm 2" << std::endl;
+    PATTERN_LOG("Executing algorithm 2");
     a2.execute();
+
+    // the cycles vary from run to run, how often each step was timed not
+    for (std::size_t i = 0; i < step_timing::steps; ++i)
+      PATTERN_LOG("\tstep " << step_timing::name(i) << " timed " 
+		  << a2.timing().histogram(i).count() << " time(s)");
   }
 
   {
     using  namespace Behavioural_Patterns::Visitor;
 
-    std::cout << "Example of Visitor" << std::endl;    
+    PATTERN_LOG("Example of Visitor");    
 
     Parent p;
     parent_model_one_visitor vis1;
@@ -313,12 +737,116 @@ void behavioural(){
     vis1.visit(p);
     vis2.visit(p);
   };
+
+  {
+    using  namespace Behavioural_Patterns::Visitor;
+
+    PATTERN_LOG("Example of parallel Visitor");    
+
+    Parent p;
+    visit_pool pool(2);
+    parent_count_visitor counter;         // not thread safe, merged
+
+    parallel_visit(p, counter, pool);
+    PATTERN_LOG("\tcounted " << counter.a << " A, " << counter.b 
+		<< " B, " << counter.c << " C");
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Visitor;
+
+    PATTERN_LOG("Example of Visitor over variants");    
+
+    flat_parent p;
+    p.add(A());
+    p.add(C());
+    p.add(B());
+
+    parent_model_one_visitor vis1;
+    p.accept(vis1);                       // one virtual call per element
+
+    p.visit(overloaded{                   // no virtual call at all
+	[](A &a) { PATTERN_LOG("\tvisit A, lambda"); },
+	[](B &b) { PATTERN_LOG("\tvisit B, lambda"); },
+	[](C &c) { PATTERN_LOG("\tvisit C, lambda"); } });
+  }
+
+  {
+    using  namespace Behavioural_Patterns::Interpreter;
+
+    PATTERN_LOG("Example of Interpreter");    
+
+    syntax_tree rule("price * qty > 100 && !(region == 3) ? "
+		     "price * qty * (1 - 0.1) : 0");
+    double vars[] = { 30, 4, 1 };         // price, qty, region
+
+    PATTERN_LOG("\ttree walked: " << rule.interpret(vars));
+
+    program p = rule.compile();
+    PATTERN_LOG("\tcompiled to " << p.code().size() 
+		<< " instructions:");
+    std::ostringstream code;
+    p.dump(code);
+    PATTERN_LOG_PART(code.str());
+    PATTERN_LOG("\tbytecode: " << p.run(vars));
+
+    double price[] = { 30, 30, 10 }, qty[] = { 4, 4, 4 }, region[] = { 1, 3, 1 };
+    const double * columns[] = { price, qty, region };
+    double out[3];
+    p.run(columns, out);                  // three rows at once
+    PATTERN_LOG("\tcolumns: " << out[0] << " " << out[1] << " " << out[2]);
+
+    // rules come from users: nesting is bounded, not the stack
+    const std::size_t deep = 100000;
+    for (std::string text : { std::string(deep, '!') + "1", 
+			      std::string(deep, '(') + "1", 
+			      std::string(deep, '-') + "1" })
+      try{
+	syntax_tree too_deep(text);
+      }
+      catch (const std::invalid_argument & e){
+	PATTERN_LOG("\t" << deep << " deep rejected: " << e.what());
+      }
+    std::string chain = "1";
+    for (std::size_t i = 0; i < deep; ++i)
+      chain += "+1";
+    syntax_tree flat(chain);              // long, not deep
+    PATTERN_LOG("\t" << deep << " long chain: " << flat.interpret(vars) 
+		<< ", compiled " << flat.compile().run(vars));
+    std::string any = "region == 0";
+    for (int r = 1; r < 300; ++r)
+      any += " || region == " + std::to_string(r);
+    syntax_tree alternatives(any, { "price", "qty", "region" });
+    PATTERN_LOG("\t300 alternatives: " << alternatives.interpret(vars) 
+		<< ", compiled " << alternatives.compile().run(vars));
+
+    program_cache cache(128);
+    program_cache::program_ptr p1 = cache.get("price * qty > 100");
+    program_cache::program_ptr p2 = cache.get("price*qty  >  100");
+    program_cache::cache_stats st = cache.stats();
+    PATTERN_LOG("\tcache: " << (p1 == p2 ? "same program" : "two programs")
+		<< ", hit rate " << st.hit_rate);
+    for (const char * text : { "1e-5", "1e -5", "1e- 5" })
+      try{                      // spaces that split a number are kept
+	program_cache::program_ptr p = cache.get(text);
+	PATTERN_LOG("\t\"" << text << "\" = " << p->run(vars));
+      }
+      catch (const std::invalid_argument & e){
+	PATTERN_LOG("\t\"" << text << "\" rejected: " << e.what());
+      }
+    cache.clear();
+    PATTERN_LOG("\tcleared, hit rate " << cache.stats().hit_rate);
+  }
 }
 
 
 
 int main(){
 
+  // some demos print from other threads too; in ASYNC mode their
+  // lines could come out after the ones printed next
+  Logging::set_mode(Logging::mode::SYNC);
+
   creational();
   structural();
   behavioural();